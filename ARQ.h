@@ -0,0 +1,127 @@
+// Copyright (C) 2024, Mark Qvist
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Stop-and-wait ARQ for point-to-point links. Data
+// frames carry a running sequence number in the
+// header, and the receiver answers every complete
+// packet with a header-only ACK frame. Data packets
+// end with a session epoch byte, picked at random
+// whenever ARQ is enabled, so that a peer which has
+// restarted its sequence numbers is never mistaken
+// for a retransmission. Like CSMA.h,
+// this has no dependencies on Arduino or the modem,
+// so the simulator can run the same state machine.
+
+#ifndef ARQ_H
+  #define ARQ_H
+  #include <stdint.h>
+  #include <math.h>
+
+  #define ARQ_SEQ_MASK           0x0F
+  #define ARQ_SEQ_UNSET          0xFF
+  #define ARQ_TIMEOUT_MARGIN_MS  150
+  #define ARQ_DUP_WINDOW_MS      30000
+  #define ARQ_EPOCH_L            1
+
+  #define ARQ_IDLE               0x00
+  #define ARQ_WAIT               0x01
+  #define ARQ_RETRANSMIT         0x02
+
+  typedef struct {
+    // Sender side
+    bool     waiting;
+    uint8_t  seq;
+    uint8_t  epoch;
+    uint8_t  attempts;
+    uint32_t sent_at;
+    volatile bool    acked;
+    // Receiver side
+    uint8_t  rx_seq;
+    uint8_t  rx_epoch;
+    uint32_t rx_at;
+    volatile bool    ack_due;
+    volatile uint8_t ack_seq;
+    // Statistics
+    uint32_t stat_acked;
+    uint32_t stat_retransmits;
+    uint32_t stat_failed;
+    uint32_t stat_duplicates;
+  } arq_state_t;
+  #define ARQ_STATE_INIT {false, 0, 0, 0, 0, false, ARQ_SEQ_UNSET, 0, 0, false, 0, 0, 0, 0, 0}
+
+  // Time to wait for an ACK after the last frame of
+  // a packet has been sent
+  static inline uint32_t arq_timeout_ms(float ack_airtime_ms) {
+    return (uint32_t)ceil(ack_airtime_ms) + ARQ_TIMEOUT_MARGIN_MS;
+  }
+
+  // Takes the sequence number for a new packet. The
+  // packet must be sent with it before arq_tx_sent().
+  static inline uint8_t arq_tx_begin(arq_state_t *s) {
+    s->seq = (s->seq+1) & ARQ_SEQ_MASK;
+    s->attempts = 0;
+    s->acked = false;
+    return s->seq;
+  }
+
+  // Starts waiting for the ACK, once all frames of the
+  // packet have been sent
+  static inline void arq_tx_sent(arq_state_t *s, uint32_t now) {
+    if (s->attempts > 0) { s->stat_retransmits++; }
+    s->attempts++;
+    s->sent_at = now;
+    s->waiting = true;
+  }
+
+  // Called for every received ACK frame
+  static inline void arq_ack_received(arq_state_t *s, uint8_t sequence) {
+    if (s->waiting && sequence == s->seq) { s->acked = true; }
+  }
+
+  // Advances the sender. ARQ_WAIT holds back new
+  // packets, and ARQ_RETRANSMIT asks for the packet
+  // to be sent again after a new channel access.
+  static inline uint8_t arq_tx_step(arq_state_t *s, uint32_t now, uint32_t timeout_ms, uint8_t retries) {
+    if (!s->waiting) { return ARQ_IDLE; }
+    if (s->acked) { s->waiting = false; s->stat_acked++; return ARQ_IDLE; }
+    if (now-s->sent_at < timeout_ms) { return ARQ_WAIT; }
+    if (s->attempts > retries) { s->waiting = false; s->stat_failed++; return ARQ_IDLE; }
+    return ARQ_RETRANSMIT;
+  }
+
+  // Starts a new session with a fresh sequence number
+  // and epoch, from values picked by the caller
+  static inline void arq_session_begin(arq_state_t *s, uint8_t sequence, uint8_t epoch) {
+    s->seq = sequence & ARQ_SEQ_MASK;
+    s->epoch = epoch;
+    s->waiting = false;
+  }
+
+  // Called for every complete packet received with a
+  // sequence number. Schedules the ACK, and returns
+  // false if the packet is a retransmission of the
+  // last one already passed on.
+  static inline bool arq_rx_accept(arq_state_t *s, uint8_t sequence, uint8_t epoch, uint32_t now) {
+    s->ack_seq = sequence;
+    s->ack_due = true;
+    bool duplicate = sequence == s->rx_seq && epoch == s->rx_epoch && now-s->rx_at < ARQ_DUP_WINDOW_MS;
+    s->rx_seq = sequence;
+    s->rx_epoch = epoch;
+    s->rx_at = now;
+    if (duplicate) { s->stat_duplicates++; }
+    return !duplicate;
+  }
+
+#endif
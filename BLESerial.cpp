@@ -26,6 +26,7 @@ bool bt_security_request_callback();
 void bt_authentication_complete_callback(esp_ble_auth_cmpl_t auth_result);
 bool bt_confirm_pin_callback(uint32_t pin);
 void bt_connect_callback(BLEServer *server);
+void bt_link_connected_callback(esp_ble_gatts_cb_param_t *param);
 void bt_disconnect_callback(BLEServer *server);
 bool bt_client_authenticated();
 
@@ -34,21 +35,17 @@ void BLESerial::onPassKeyNotify(uint32_t passkey) { bt_passkey_notify_callback(p
 bool BLESerial::onSecurityRequest() { return bt_security_request_callback(); }
 void BLESerial::onAuthenticationComplete(esp_ble_auth_cmpl_t auth_result) { bt_authentication_complete_callback(auth_result); }
 void BLESerial::onConnect(BLEServer *server) { bt_connect_callback(server); }
+void BLESerial::onConnect(BLEServer *server, esp_ble_gatts_cb_param_t *param) {
+  memcpy(peer_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+  bt_link_connected_callback(param);
+}
 void BLESerial::onDisconnect(BLEServer *server) { bt_disconnect_callback(server); ble_server->startAdvertising(); }
 bool BLESerial::onConfirmPIN(uint32_t pin) { return bt_confirm_pin_callback(pin); };
 bool BLESerial::connected() { return ble_server->getConnectedCount() > 0; }
 
-int BLESerial::read() {
-  int result = this->rx_buffer.pop();
-  if (result == '\n') { this->numAvailableLines--; }
-  return result;
-}
+int BLESerial::read() { return this->rx_buffer.pop(); }
 
-size_t BLESerial::readBytes(uint8_t *buffer, size_t bufferSize) {
-  int i = 0;
-  while (i < bufferSize && available()) { buffer[i] = (uint8_t)this->rx_buffer.pop(); i++; }
-  return i;
-}
+size_t BLESerial::readBytes(uint8_t *buffer, size_t bufferSize) { return this->rx_buffer.pop(buffer, bufferSize); }
 
 int BLESerial::peek() {
   if (this->rx_buffer.getLength() == 0) return -1;
@@ -57,6 +54,8 @@ int BLESerial::peek() {
 
 int BLESerial::available() { return this->rx_buffer.getLength(); }
 
+uint32_t BLESerial::rxOverflows() { return this->rx_buffer.getOverflowCount(); }
+
 size_t BLESerial::print(const char *str) {
   if (ble_server->getConnectedCount() <= 0) return 0;
   size_t written = 0; for (size_t i = 0; str[i] != '\0'; i++)  { written += this->write(str[i]); }
@@ -143,7 +142,7 @@ void BLESerial::end() { BLEDevice::deinit(); }
 void BLESerial::onWrite(BLECharacteristic *characteristic) {
   if (characteristic->getUUID().toString() == BLE_RX_UUID) {
     auto value = characteristic->getValue();
-    for (int i = 0; i < value.length(); i++) { rx_buffer.push(value[i]); }
+    rx_buffer.push((const uint8_t*)value.c_str(), value.length());
   }
 }
 
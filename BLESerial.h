@@ -19,56 +19,90 @@
 #if HAS_BLE
 
 #include <Arduino.h>
+#include <atomic>
 
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEServer.h>
 #include <BLE2902.h>
 
+// Lock-free single-producer, single-consumer ring
+// buffer. The BLE stack task is the only producer
+// (onWrite), and loop() is the only consumer. The
+// head index is only ever written by the producer,
+// and the tail index only by the consumer, so the
+// release/acquire pairs below are sufficient to
+// make the buffer safe across both ESP32 cores.
+// If the buffer is full, incoming bytes are dropped
+// and counted, instead of overwriting unread data.
 template <size_t n>
 class BLEFIFO {
+	static_assert(n > 0 && (n & (n - 1)) == 0, "BLEFIFO size must be a power of two");
+
 private:
+	static const size_t mask = n - 1;
 	uint8_t buffer[n];
-	int head = 0;
-	int tail = 0;
+	std::atomic<size_t> head{0};
+	std::atomic<size_t> tail{0};
+	std::atomic<uint32_t> overflows{0};
 
 public:
-	void push(uint8_t value) {
-		buffer[head] = value;
-		head = (head + 1) % n;
-		if (head == tail) { tail = (tail + 1) % n; }
+	size_t push(const uint8_t *data, size_t len) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t t = tail.load(std::memory_order_acquire);
+		size_t space = n - (h - t);
+		if (len > space) { overflows.fetch_add(len - space, std::memory_order_relaxed); len = space; }
+		if (len == 0) { return 0; }
+
+		size_t offset = h & mask;
+		size_t first = n - offset; if (first > len) { first = len; }
+		memcpy(buffer + offset, data, first);
+		memcpy(buffer, data + first, len - first);
+		head.store(h + len, std::memory_order_release);
+		return len;
+	}
+
+	size_t pop(uint8_t *data, size_t len) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		size_t available = h - t;
+		if (len > available) { len = available; }
+		if (len == 0) { return 0; }
+
+		size_t offset = t & mask;
+		size_t first = n - offset; if (first > len) { first = len; }
+		memcpy(data, buffer + offset, first);
+		memcpy(data + first, buffer, len - first);
+		tail.store(t + len, std::memory_order_release);
+		return len;
 	}
 
 	int pop() {
-		if (head == tail) {
-			return -1;
-		} else {
-			uint8_t value = buffer[tail];
-			tail = (tail + 1) % n;
-			return value;
-		}
+		uint8_t value;
+		if (pop(&value, 1) == 0) { return -1; }
+		else                     { return value; }
 	}
 
-	void clear() { head = 0; tail = 0; }
+	// Must only be called from the consumer side
+	void clear() { tail.store(head.load(std::memory_order_acquire), std::memory_order_release); }
 
 	int get(size_t index) {
-		if (index >= this->getLength()) {
-			return -1;
-		} else {
-			return buffer[(tail + index) % n];
-		}
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		if (index >= h - t) { return -1; }
+		else                { return buffer[(t + index) & mask]; }
 	}
 
 	size_t getLength() {
-		if (head >= tail) {
-			return head - tail;
-		} else {
-			return n - tail + head;
-		}
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		return h - t;
 	}
+
+	uint32_t getOverflowCount() { return overflows.load(std::memory_order_relaxed); }
 };
 
-#define RX_BUFFER_SIZE 6144
+#define RX_BUFFER_SIZE 8192 // Must be a power of two
 #define BLE_BUFFER_SIZE 512 // Must fit in max GATT attribute length
 #define MIN_MTU 50
 
@@ -91,6 +125,7 @@ public:
   size_t print(const char *value);
   void flush();
   void onConnect(BLEServer *server);
+  void onConnect(BLEServer *server, esp_ble_gatts_cb_param_t *param);
   void onDisconnect(BLEServer *server);
 
   uint32_t onPassKeyRequest();
@@ -100,6 +135,7 @@ public:
   bool onConfirmPIN(uint32_t pin);
 
   bool connected();
+  uint32_t rxOverflows();
 
   BLEServer *ble_server;
   BLEAdvertising *ble_adv;
@@ -108,13 +144,13 @@ public:
   BLECharacteristic *RxCharacteristic;
   size_t transmitBufferLength;
   unsigned long long lastFlushTime;
+  esp_bd_addr_t peer_bda;
 
 private:
   BLESerial(BLESerial const &other) = delete;
   void operator=(BLESerial const &other) = delete;
 
   BLEFIFO<RX_BUFFER_SIZE> rx_buffer;
-  size_t numAvailableLines;
   uint8_t transmitBuffer[BLE_BUFFER_SIZE];
 
   int ConnectedDeviceCount;
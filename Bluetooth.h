@@ -35,6 +35,10 @@
   #include <bluefruit.h>
   #include <math.h>
   #define BLE_RX_BUF 6144
+  #define BLE_LINK_MTU 247
+  #define BLE_CONN_EVENT_LEN 12  // 15 ms, in units of 1.25 ms
+  #define BLE_HVN_QUEUE_SIZE 8
+  #define BLE_WRCMD_QUEUE_SIZE 4
   BLEUart SerialBT(BLE_RX_BUF);
   BLEDis  bledis;
   BLEBas  blebas;
@@ -45,6 +49,59 @@
 #define BLE_FLUSH_TIMEOUT 20
 uint32_t bt_pairing_started = 0;
 
+#if HAS_BLE == true
+  // Link parameters requested from the central once a
+  // connection is up. Intervals are in units of 1.25 ms
+  // and the supervision timeout in units of 10 ms. The
+  // central has the final say, so the values actually in
+  // effect are tracked separately in the ble_link_*
+  // variables and reported to the host on change.
+  #define BLE_CONN_INTERVAL_MIN 6   // 7.5 ms
+  #define BLE_CONN_INTERVAL_MAX 12  // 15 ms
+  #define BLE_CONN_LATENCY      0
+  #define BLE_CONN_TIMEOUT      400 // 4 seconds
+  #define BLE_LINK_OPT_DLE      0x01
+  #define BLE_LINK_OPT_PHY_2M   0x02
+  #define BLE_LINK_OPT_COALESCE 0x04 // nRF52 only, frames share notifications
+  #define BLE_LINK_OPTS         (BLE_LINK_OPT_DLE | BLE_LINK_OPT_PHY_2M | BLE_LINK_OPT_COALESCE)
+  #define BLE_LINK_PHY_1M       0x01
+  #define BLE_LINK_PHY_2M       0x02
+  #define BLE_LINK_DATA_LEN     251
+  #define BLE_LINK_POLL_INTERVAL 250
+
+  uint16_t ble_conn_interval_min = BLE_CONN_INTERVAL_MIN;
+  uint16_t ble_conn_interval_max = BLE_CONN_INTERVAL_MAX;
+  uint16_t ble_conn_latency = BLE_CONN_LATENCY;
+  uint16_t ble_conn_timeout = BLE_CONN_TIMEOUT;
+  uint8_t  ble_link_opts = BLE_LINK_OPT_DLE | BLE_LINK_OPT_PHY_2M;
+
+  volatile uint16_t ble_link_interval = 0;
+  volatile uint16_t ble_link_latency = 0;
+  volatile uint16_t ble_link_timeout = 0;
+  volatile uint16_t ble_link_mtu = 0;
+  volatile uint16_t ble_link_data_len = 0;
+  volatile uint8_t  ble_link_phy = 0;
+  volatile bool ble_link_changed = false;
+  uint32_t ble_link_last_poll = 0;
+
+  void kiss_indicate_bt_link();
+
+  void bt_link_reset() {
+    ble_link_interval = 0; ble_link_latency = 0; ble_link_timeout = 0;
+    ble_link_mtu = 0; ble_link_data_len = 0; ble_link_phy = 0;
+    ble_link_changed = false;
+  }
+
+  bool bt_link_params_valid(uint16_t imin, uint16_t imax, uint16_t latency, uint16_t timeout) {
+    // Ranges permitted by the Bluetooth Core specification
+    if (imin < 6 || imax > 3200 || imin > imax) return false;
+    if (latency > 499 || timeout < 10 || timeout > 3200) return false;
+    // Supervision timeout must exceed (1+latency)*interval*2
+    if ((uint32_t)timeout*10*4 <= (uint32_t)(1+latency)*imax*5*2) return false;
+    return true;
+  }
+#endif
+
 #define BT_DEV_ADDR_LEN 6
 #define BT_DEV_HASH_LEN 16
 uint8_t dev_bt_mac[BT_DEV_ADDR_LEN];
@@ -120,7 +177,7 @@ char bt_devname[11];
 
     bool bt_setup_hw() {
       if (!bt_ready) {
-        if (EEPROM.read(eeprom_addr(ADDR_CONF_BT)) == BT_ENABLE_BYTE) {
+        if (device_config.bt == BT_ENABLE_BYTE) {
           bt_enabled = true;
         } else {
           bt_enabled = false;
@@ -309,18 +366,76 @@ char bt_devname[11];
       cable_state = CABLE_STATE_DISCONNECTED;
     }
 
+    void bt_request_link_params() {
+      // Requests are best effort. If the central rejects any
+      // of them, the link simply stays on the parameters it
+      // chose, and the GAP events report what is in effect.
+      esp_ble_conn_update_params_t params;
+      memcpy(params.bda, SerialBT.peer_bda, sizeof(esp_bd_addr_t));
+      params.min_int = ble_conn_interval_min;
+      params.max_int = ble_conn_interval_max;
+      params.latency = ble_conn_latency;
+      params.timeout = ble_conn_timeout;
+      esp_ble_gap_update_conn_params(&params);
+
+      if (ble_link_opts & BLE_LINK_OPT_DLE) {
+        esp_ble_gap_set_pkt_data_len(SerialBT.peer_bda, BLE_LINK_DATA_LEN);
+      }
+
+      #if defined(SOC_BLE_50_SUPPORTED) && defined(CONFIG_BT_BLE_50_FEATURES_SUPPORTED)
+        if (ble_link_opts & BLE_LINK_OPT_PHY_2M) {
+          esp_ble_gap_set_preferred_phy(SerialBT.peer_bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+        }
+      #endif
+    }
+
+    void bt_link_connected_callback(esp_ble_gatts_cb_param_t *param) {
+      bt_link_reset();
+      ble_link_interval = param->connect.conn_params.interval;
+      ble_link_latency = param->connect.conn_params.latency;
+      ble_link_timeout = param->connect.conn_params.timeout;
+      ble_link_phy = BLE_LINK_PHY_1M;
+      ble_link_changed = true;
+      bt_request_link_params();
+    }
+
+    void bt_gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+      if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT) {
+        if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS) {
+          ble_link_interval = param->update_conn_params.conn_int;
+          ble_link_latency = param->update_conn_params.latency;
+          ble_link_timeout = param->update_conn_params.timeout;
+          ble_link_changed = true;
+        }
+      } else if (event == ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT) {
+        if (param->pkt_data_length_cmpl.status == ESP_BT_STATUS_SUCCESS) {
+          ble_link_data_len = param->pkt_data_length_cmpl.params.tx_len;
+          ble_link_changed = true;
+        }
+      }
+      #if defined(SOC_BLE_50_SUPPORTED) && defined(CONFIG_BT_BLE_50_FEATURES_SUPPORTED)
+        else if (event == ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT) {
+          if (param->phy_update.status == ESP_BT_STATUS_SUCCESS) {
+            ble_link_phy = param->phy_update.tx_phy == ESP_BLE_GAP_PHY_2M ? BLE_LINK_PHY_2M : BLE_LINK_PHY_1M;
+            ble_link_changed = true;
+          }
+        }
+      #endif
+    }
+
     void bt_disconnect_callback(BLEServer *server) {
       uint16_t conn_id = server->getConnId();
       // Serial.printf("Disconnected: %d\n", conn_id);
       display_unblank();
       ble_authenticated = false;
       bt_state = BT_STATE_ON;
+      bt_link_reset();
     }
 
     bool bt_setup_hw() {
       // Serial.println("BT setup hw");
       if (!bt_ready) {
-        if (EEPROM.read(eeprom_addr(ADDR_CONF_BT)) == BT_ENABLE_BYTE) {
+        if (device_config.bt == BT_ENABLE_BYTE) {
           bt_enabled = true;
         } else {
           bt_enabled = false;
@@ -340,6 +455,7 @@ char bt_devname[11];
               free(data);
 
               bt_security_setup();
+              BLEDevice::setCustomGapHandler(bt_gap_event_handler);
 
               bt_ready = true;
               return true;
@@ -385,6 +501,15 @@ char bt_devname[11];
           bt_flush();
         }
       }
+      if (bt_state == BT_STATE_CONNECTED && millis()-ble_link_last_poll >= BLE_LINK_POLL_INTERVAL) {
+        ble_link_last_poll = millis();
+        uint16_t mtu = SerialBT.ble_server->getPeerMTU(SerialBT.ble_server->getConnId());
+        if (mtu != ble_link_mtu) { ble_link_mtu = mtu; ble_link_changed = true; }
+        if (ble_link_changed && bt_client_authenticated()) {
+          ble_link_changed = false;
+          kiss_indicate_bt_link();
+        }
+      }
     }
   #endif
 
@@ -401,7 +526,20 @@ char bt_devname[11];
     }
   }
 
-  void bt_flush() { if (bt_state == BT_STATE_CONNECTED) { SerialBT.flushTXD(); } }
+  // Time to wait for another frame before flushing the
+  // remainder of the TX buffer, and the upper bound on how
+  // long buffered data may be held back during a burst.
+  #define BLE_FLUSH_HOLDOFF 2
+  bool bt_tx_pending = false;
+  uint32_t bt_tx_pending_since = 0;
+  uint32_t bt_tx_last_frame = 0;
+
+  void bt_flush() { if (bt_state == BT_STATE_CONNECTED) { SerialBT.flushTXD(); } bt_tx_pending = false; }
+
+  void bt_tx_frame_end() {
+    bt_tx_last_frame = millis();
+    if (!bt_tx_pending) { bt_tx_pending = true; bt_tx_pending_since = bt_tx_last_frame; }
+  }
 
   void bt_disable_pairing() {
     // Serial.println("BT Disable pairing");
@@ -459,15 +597,41 @@ char bt_devname[11];
     return false;
   }
 
+  uint16_t bt_conn_handle = BLE_CONN_HANDLE_INVALID;
+
+  void bt_request_link_params() {
+    // Requests are best effort. If the central rejects any
+    // of them, the link stays on the parameters it chose,
+    // which update_bt will pick up and report.
+    BLEConnection* conn = Bluefruit.Connection(bt_conn_handle);
+    if (conn == NULL) return;
+    if (ble_link_opts & BLE_LINK_OPT_PHY_2M) { conn->requestPHY(BLE_GAP_PHY_2MBPS); }
+    conn->requestMtuExchange(BLE_LINK_MTU);
+    if (ble_link_opts & BLE_LINK_OPT_DLE) { conn->requestDataLengthUpdate(); }
+
+    // BLEConnection only takes a single interval, so the
+    // range is requested from the SoftDevice directly
+    ble_gap_conn_params_t params;
+    params.min_conn_interval = ble_conn_interval_min;
+    params.max_conn_interval = ble_conn_interval_max;
+    params.slave_latency = ble_conn_latency;
+    params.conn_sup_timeout = ble_conn_timeout;
+    sd_ble_gap_conn_param_update(bt_conn_handle, &params);
+  }
+
+  bool bt_client_authenticated() {
+    BLEConnection* conn = Bluefruit.Connection(bt_conn_handle);
+    return conn != NULL && conn->connected() && conn->secured();
+  }
+
   void bt_connect_callback(uint16_t conn_handle) {
     // Serial.println("Connect callback");
     bt_state = BT_STATE_CONNECTED;
     cable_state = CABLE_STATE_DISCONNECTED;
 
-    BLEConnection* conn = Bluefruit.Connection(conn_handle);
-    conn->requestPHY(BLE_GAP_PHY_2MBPS);
-    conn->requestMtuExchange(512+3);
-    conn->requestDataLengthUpdate();
+    bt_conn_handle = conn_handle;
+    bt_link_reset();
+    bt_request_link_params();
   }
 
   void bt_disconnect_callback(uint16_t conn_handle, uint8_t reason) {
@@ -475,6 +639,25 @@ char bt_devname[11];
     if (reason != BLE_GAP_SEC_STATUS_SUCCESS) {
         bt_state = BT_STATE_ON;
     }
+    bt_conn_handle = BLE_CONN_HANDLE_INVALID;
+    bt_link_reset();
+  }
+
+  void bt_poll_link() {
+    BLEConnection* conn = Bluefruit.Connection(bt_conn_handle);
+    if (conn == NULL || !conn->connected()) return;
+    uint16_t interval = conn->getConnectionInterval();
+    uint16_t latency = conn->getSlaveLatency();
+    uint16_t timeout = conn->getSupervisionTimeout();
+    uint16_t mtu = conn->getMtu();
+    uint16_t data_len = conn->getDataLength();
+    uint8_t phy = conn->getPHY() == BLE_GAP_PHY_2MBPS ? BLE_LINK_PHY_2M : BLE_LINK_PHY_1M;
+    if (interval != ble_link_interval || latency != ble_link_latency || timeout != ble_link_timeout ||
+        mtu != ble_link_mtu || data_len != ble_link_data_len || phy != ble_link_phy) {
+      ble_link_interval = interval; ble_link_latency = latency; ble_link_timeout = timeout;
+      ble_link_mtu = mtu; ble_link_data_len = data_len; ble_link_phy = phy;
+      ble_link_changed = true;
+    }
   }
 
   void bt_update_passkey() {
@@ -492,16 +675,15 @@ char bt_devname[11];
   bool bt_setup_hw() {
     // Serial.println("Setup HW");
     if (!bt_ready) {
-      #if HAS_EEPROM 
-          if (EEPROM.read(eeprom_addr(ADDR_CONF_BT)) == BT_ENABLE_BYTE) {
-      #else
-          if (eeprom_read(eeprom_addr(ADDR_CONF_BT)) == BT_ENABLE_BYTE) {
-      #endif
+      if (device_config.bt == BT_ENABLE_BYTE) {
         bt_enabled = true;
       } else {
         bt_enabled = false;
       }
-      Bluefruit.configPrphBandwidth(BANDWIDTH_MAX);
+      // Equivalent to BANDWIDTH_MAX, but with deeper notification
+      // and write queues, so the SoftDevice can move several
+      // packets per connection event during RX bursts.
+      Bluefruit.configPrphConn(BLE_LINK_MTU, BLE_CONN_EVENT_LEN, BLE_HVN_QUEUE_SIZE, BLE_WRCMD_QUEUE_SIZE);
       Bluefruit.autoConnLed(false);
       if (Bluefruit.begin()) {
         uint32_t pin = bt_get_passkey();
@@ -520,7 +702,7 @@ char bt_devname[11];
         Bluefruit.Security.setPIN(pin_char);
         Bluefruit.Periph.setDisconnectCallback(bt_disconnect_callback);
         Bluefruit.Security.setPairCompleteCallback(bt_pairing_complete);
-        Bluefruit.Periph.setConnInterval(6, 12); // 7.5 - 15 ms
+        Bluefruit.Periph.setConnInterval(ble_conn_interval_min, ble_conn_interval_max);
 
         const ble_gap_addr_t gap_addr = Bluefruit.getAddr();
         char *data = (char*)malloc(BT_DEV_ADDR_LEN+1);
@@ -611,5 +793,17 @@ char bt_devname[11];
     if (bt_allow_pairing && millis()-bt_pairing_started >= BT_PAIRING_TIMEOUT) {
       bt_disable_pairing();
     }
+    if (bt_tx_pending) {
+      uint32_t now = millis();
+      if (now-bt_tx_last_frame >= BLE_FLUSH_HOLDOFF || now-bt_tx_pending_since >= BLE_FLUSH_TIMEOUT) { bt_flush(); }
+    }
+    if (bt_state == BT_STATE_CONNECTED && millis()-ble_link_last_poll >= BLE_LINK_POLL_INTERVAL) {
+      ble_link_last_poll = millis();
+      bt_poll_link();
+      if (ble_link_changed && bt_client_authenticated()) {
+        ble_link_changed = false;
+        kiss_indicate_bt_link();
+      }
+    }
   }
 #endif
@@ -936,4 +936,108 @@
     #define NP_M 0.15
   #endif
 
+  // Partition hashes are cached across warm resets,
+  // and fully recomputed at least this many boots
+  #ifndef FW_HASH_CACHE
+    #define FW_HASH_CACHE true
+  #endif
+
+  #ifndef FW_HASH_CACHE_MAX_BOOTS
+    #define FW_HASH_CACHE_MAX_BOOTS 16
+  #endif
+
+  // If enabled, uncached firmware validation runs in
+  // a background task after the radio has started
+  #ifndef FW_VALIDATION_DEFERRED
+    #define FW_VALIDATION_DEFERRED false
+  #endif
+
+  // If enabled, display, Bluetooth advertising and
+  // WiFi are brought up in stages from the main
+  // loop after the radio has started
+  #ifndef BOOT_DEFER_PERIPHERALS
+    #define BOOT_DEFER_PERIPHERALS false
+  #endif
+
+  // Transmit priority classes are served in strict
+  // priority order, or by weighted round robin if
+  // this is enabled
+  #ifndef TX_QUEUE_WEIGHTED
+    #define TX_QUEUE_WEIGHTED false
+  #endif
+
+  // Default time to live in milliseconds for queued
+  // packets, after which they are dropped instead of
+  // transmitted. Zero disables expiry.
+  #ifndef QUEUE_TTL_MS
+    #define QUEUE_TTL_MS 0
+  #endif
+
+  // Number of split packets that can be partially
+  // received at the same time. If fingerprinting is
+  // enabled, the second part of a split packet must
+  // also arrive within the RSSI tolerance in dB of
+  // the first part to be joined with it.
+  #ifndef REASM_SLOTS
+    #define REASM_SLOTS 4
+  #endif
+
+  #ifndef REASM_FINGERPRINT
+    #define REASM_FINGERPRINT true
+  #endif
+
+  #ifndef REASM_RSSI_TOLERANCE
+    #define REASM_RSSI_TOLERANCE 10
+  #endif
+
+  // Support for the fragmentation mode is a build
+  // option, since the larger packet buffers and the
+  // reassembly slots take about 7.5 KB of RAM
+  #ifndef FRAG_MODE
+    #define FRAG_MODE false
+  #endif
+
+  #if FRAG_MODE && (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52)
+    #define HAS_FRAG true
+  #else
+    #define HAS_FRAG false
+  #endif
+
+  // In fragmentation mode, packets larger than the
+  // MTU are sent as up to this many segments, and
+  // this many of them can be reassembled at once
+  #ifndef FRAG_MAX_SEGMENTS
+    #define FRAG_MAX_SEGMENTS 8
+  #endif
+
+  #ifndef FRAG_SLOTS
+    #define FRAG_SLOTS 2
+  #endif
+
+  // Longest time in milliseconds that a small packet
+  // is held back for other packets to share its frame
+  // with. Zero disables aggregation.
+  #ifndef AGGR_WINDOW_MS
+    #define AGGR_WINDOW_MS 0
+  #endif
+
+  // Number of times a packet is retransmitted in ARQ
+  // mode before it is given up on
+  #ifndef ARQ_RETRIES
+    #define ARQ_RETRIES 3
+  #endif
+
+  // SX126x and SX128x modems can use channel activity
+  // detection for carrier sense during channel access.
+  // CSMA_CAD sets whether it is enabled at boot.
+  #if (MODEM == SX1262 || MODEM == SX1280) && (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52)
+    #define HAS_CAD true
+  #else
+    #define HAS_CAD false
+  #endif
+
+  #ifndef CSMA_CAD
+    #define CSMA_CAD false
+  #endif
+
 #endif
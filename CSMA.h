@@ -0,0 +1,155 @@
+// Copyright (C) 2024, Mark Qvist
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Channel access and airtime logic. Everything in
+// here takes its inputs as arguments and has no
+// dependencies on Arduino or the modem, so that
+// the simulator in Simulator/ can run the exact
+// same code as the firmware does.
+
+#ifndef CSMA_H
+  #define CSMA_H
+  #include <stdint.h>
+
+  #define PHY_HEADER_LORA_SYMBOLS    20
+  #define PHY_CRC_LORA_BITS          16
+
+  // Defaults for the runtime CSMA profile
+  #define CSMA_SIFS_MS               0
+  #define CSMA_DIFS_SLOTS            2
+  #define CSMA_SLOT_MAX_MS           100
+  #define CSMA_SLOT_MIN_MS           24
+  #define CSMA_SLOT_MIN_FAST_DELTA   18
+  #define CSMA_SLOT_SYMBOLS          12
+  #define CSMA_CW_BANDS              4
+  #define CSMA_CW_PER_BAND_WINDOWS   15
+  #define CSMA_BAND_1_MAX_AIRTIME    7
+  #define CSMA_BAND_N_MIN_AIRTIME    85
+
+  // Contention parameters. Airtime figures are
+  // in percent.
+  typedef struct __attribute__((packed)) {
+    uint8_t  slot_min_ms;
+    uint8_t  slot_max_ms;
+    uint8_t  slot_symbols;
+    uint8_t  cw_bands;
+    uint8_t  cw_per_band;
+    uint8_t  band_1_max_airtime;
+    uint8_t  band_n_min_airtime;
+    uint8_t  sifs_ms;
+    uint8_t  difs_slots;
+  } csma_profile_t;
+
+  const csma_profile_t csma_profile_default = {
+    CSMA_SLOT_MIN_MS, CSMA_SLOT_MAX_MS, CSMA_SLOT_SYMBOLS,
+    CSMA_CW_BANDS, CSMA_CW_PER_BAND_WINDOWS,
+    CSMA_BAND_1_MAX_AIRTIME, CSMA_BAND_N_MIN_AIRTIME,
+    CSMA_SIFS_MS, CSMA_DIFS_SLOTS,
+  };
+
+  // Wait state for the packet at the head of the
+  // transmit queue
+  #define CSMA_WAIT_IDLE 0xFFFFFFFF
+  typedef struct {
+    uint32_t difs_wait_start;
+    uint32_t cw_wait_start;
+    uint32_t cw_wait_target;
+    uint32_t cw_wait_passed;
+    int16_t  cw;
+  } csma_state_t;
+  #define CSMA_STATE_INIT {CSMA_WAIT_IDLE, CSMA_WAIT_IDLE, CSMA_WAIT_IDLE, 0, -1}
+
+  typedef long (*csma_random_t)(long, long);
+
+  // Runs one pass of the DIFS and contention window
+  // wait. Returns true once the station may transmit,
+  // after which the state is ready for the next packet.
+  static inline bool csma_step(csma_state_t *s, uint32_t now, bool medium_free, int slot_ms, uint32_t difs_ms, uint8_t cw_min, uint8_t cw_max, csma_random_t rnd) {
+    if (s->cw == -1) {
+      s->cw = rnd(cw_min, cw_max);
+      s->cw_wait_target = s->cw * slot_ms;
+    }
+
+    if (s->difs_wait_start == CSMA_WAIT_IDLE) {                                             // DIFS wait not yet started
+      if (medium_free) { s->difs_wait_start = now; }                                        // Set DIFS wait start time
+      return false; }                                                                       // Medium not yet free, continue waiting
+
+    else {                                                                                  // We are waiting for DIFS or CW to pass
+      if (!medium_free) { s->difs_wait_start = CSMA_WAIT_IDLE; s->cw_wait_start = CSMA_WAIT_IDLE; return false; }  // Medium became occupied while in DIFS wait, restart waiting when free again
+      if (now < s->difs_wait_start+difs_ms) { return false; }                               // DIFS has not yet passed, continue waiting
+      if (s->cw_wait_start == CSMA_WAIT_IDLE) { s->cw_wait_start = now; return false; }     // If we haven't started counting CW wait time, do it from now
+      s->cw_wait_passed += now-s->cw_wait_start; s->cw_wait_start = now;                    // If we are already counting CW wait time, add it to the counter
+      if (s->cw_wait_passed < s->cw_wait_target) { return false; }                          // Contention window wait time has not yet passed, continue waiting
+      s->cw_wait_passed = 0; s->cw = -1; s->difs_wait_start = CSMA_WAIT_IDLE;               // Wait time has passed, the queue can be sent
+      return true;
+    }
+  }
+
+  // Selects the contention window band for the
+  // current short term airtime
+  static inline uint8_t csma_cw_band(const csma_profile_t *p, int airtime_pct) {
+    long band;
+    if (airtime_pct <= p->band_1_max_airtime) { band = 1; }
+    else {
+      long at = airtime_pct + p->band_1_max_airtime;
+      band = (at-p->band_1_max_airtime) * (p->cw_bands-2) / (p->band_n_min_airtime-p->band_1_max_airtime) + 2;
+    }
+
+    if (band > p->cw_bands) { band = p->cw_bands; }
+    if (band < 1) { band = 1; }
+    return (uint8_t)band;
+  }
+
+  static inline uint8_t csma_cw_min(const csma_profile_t *p, uint8_t band) { return (band-1) * p->cw_per_band; }
+  static inline uint8_t csma_cw_max(const csma_profile_t *p, uint8_t band) { return (band) * p->cw_per_band - 1; }
+
+  static inline int csma_slot_time_ms(const csma_profile_t *p, float symbol_time_ms, bool fast_rate) {
+    int slot_min_ms = p->slot_min_ms;
+    if (fast_rate) { slot_min_ms -= CSMA_SLOT_MIN_FAST_DELTA; }
+    if (slot_min_ms < 1) { slot_min_ms = 1; }
+
+    int slot_ms = symbol_time_ms*p->slot_symbols;
+    if (slot_ms > p->slot_max_ms) { slot_ms = p->slot_max_ms; }
+    if (slot_ms < p->slot_min_ms) { slot_ms = slot_min_ms; }
+    return slot_ms;
+  }
+
+  static inline uint32_t csma_difs_time_ms(const csma_profile_t *p, int slot_ms) {
+    return p->sifs_ms + p->difs_slots*slot_ms;
+  }
+
+  // Airtime in milliseconds of a single LoRa frame.
+  // The SX126x and SX128x count symbols differently
+  // at spreading factors below 7.
+  static inline float lora_frame_airtime_ms(uint16_t written, int sf, int cr, long preamble_symbols, float symbol_time_ms, bool low_datarate, bool sx126x) {
+    float lora_symbols = 0;
+    int ldr_opt = 0; if (low_datarate) ldr_opt = 1;
+
+    if (sx126x && sf < 7) {
+      lora_symbols += (8*written + PHY_CRC_LORA_BITS - 4*sf + PHY_HEADER_LORA_SYMBOLS);
+      lora_symbols /=                              4*sf;
+      lora_symbols *= cr;
+      lora_symbols += preamble_symbols + 2.25 + 8;
+    } else {
+      lora_symbols += (8*written + PHY_CRC_LORA_BITS - 4*sf + 8 + PHY_HEADER_LORA_SYMBOLS);
+      lora_symbols /=                         4*(sf-2*ldr_opt);
+      lora_symbols *= cr;
+      lora_symbols += preamble_symbols + 0.25 + 8;
+    }
+
+    return lora_symbols * symbol_time_ms;
+  }
+
+#endif
@@ -15,6 +15,8 @@
 
 #include "ROM.h"
 #include "Boards.h"
+#include "CSMA.h"
+#include "ARQ.h"
 
 #ifndef CONFIG_H
 	#define CONFIG_H
@@ -48,7 +50,10 @@
 	#define WR_STATE_OFF       0x00
 	#define WR_STATE_ON        0x01
 	#define WR_STATE_CONNECTED 0x02
+	#define WR_TRANSPORT_TCP   0x00
+	#define WR_TRANSPORT_UDP   0x01
 	uint8_t wr_state = WR_STATE_OFF;
+	uint8_t wr_transport = WR_TRANSPORT_TCP;
 	uint8_t wr_channel = WR_CHANNEL_DEFAULT;
 
 	#define M_FRQ_S 27388122
@@ -62,11 +67,79 @@
 	#define MIN_L	   1
 	#define CMD_L      64
 
+	#if HAS_FRAG
+		// Fragmented packets carry a segment index and
+		// count after the header, and can span up to
+		// FRAG_MAX_SEGMENTS frames
+		#if FRAG_MAX_SEGMENTS < 3 || FRAG_MAX_SEGMENTS > 15
+			#error "FRAG_MAX_SEGMENTS must be between 3 and 15"
+		#endif
+		#define FRAG_HEADER_L  2
+		#define FRAG_SEGMENT_L (SINGLE_MTU-FRAG_HEADER_L)
+		#define FRAG_MTU       (FRAG_MAX_SEGMENTS*FRAG_SEGMENT_L)
+		#define MTU_MAX        FRAG_MTU
+		bool frag_mode = false;
+	#else
+		#define MTU_MAX        MTU
+	#endif
+
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+
+		// Aggregated frames carry several small packets,
+		// each prefixed with a one byte length
+		#define AGGR_PAYLOAD_L (SINGLE_MTU-HEADER_L)
+		#define AGGR_MAX_PACKETS 8
+		uint16_t aggr_window_ms = AGGR_WINDOW_MS;
+	#endif
+
     bool mw_radio_online = false;
 
 	#define eeprom_addr(a) (a+EEPROM_OFFSET)
 	#define config_addr(a) (a+CONFIG_OFFSET)
 
+	// Persisted device configuration, loaded and validated
+	// as one block at boot. The legacy per-byte settings in
+	// the ROM.h layout are still kept up to date alongside
+	// it, so tools reading the EEPROM directly keep working.
+	// On ESP32 the block lives in the config area from
+	// ADDR_CONF_BLOCK, on nRF52 in its own file.
+	#define DEVICE_CONFIG_MAGIC   0x73
+	#define DEVICE_CONFIG_VERSION 0x02
+
+	typedef struct __attribute__((packed)) {
+		uint8_t  magic;
+		uint8_t  version;
+		uint16_t length;
+		uint8_t  conf_sf;
+		uint8_t  conf_cr;
+		uint8_t  conf_txp;
+		uint8_t  conf_bw[4];
+		uint8_t  conf_freq[4];
+		uint8_t  conf_ok;
+		uint8_t  bt;
+		uint8_t  disp_set;
+		uint8_t  disp_int;
+		uint8_t  disp_addr;
+		uint8_t  disp_blank;
+		uint8_t  disp_blank_set;
+		uint8_t  disp_rot;
+		uint8_t  np_set;
+		uint8_t  np_int;
+		uint8_t  dis_ia;
+		uint8_t  wifi_mode;
+		uint8_t  wifi_chn;
+		uint8_t  wifi_transport;
+		uint8_t  wifi_ssid[33];
+		uint8_t  wifi_psk[33];
+		uint8_t  wifi_ip[4];
+		uint8_t  wifi_nm[4];
+		uint8_t  wifi_peer[6];
+		uint8_t  csma_set;
+		csma_profile_t csma;
+		uint16_t crc;
+	} device_config_t;
+	device_config_t device_config;
+
     #if (MODEM == SX1262 || MODEM == SX1280) && defined(NRF52840_XXAA)
         SPIClass spiModem(NRF_SPIM2, pin_miso, pin_sclk, pin_mosi);
     #endif
@@ -79,8 +152,6 @@
 	const int  rssi_offset = 157;
 
 	// Default LoRa settings
-	#define PHY_HEADER_LORA_SYMBOLS    20
-	#define PHY_CRC_LORA_BITS          16
 	#define LORA_PREAMBLE_SYMBOLS_MIN  18
 	#define LORA_PREAMBLE_TARGET_MS    24
 	#define LORA_PREAMBLE_FAST_DELTA   18
@@ -98,30 +169,20 @@
 	bool lora_limit_rate            =  false;
 	bool lora_guard_rate            =  false;
 
-	// CSMA Parameters
-	#define CSMA_SIFS_MS               0
+	// CSMA Parameters. The slot, contention window
+	// and DIFS defaults for the runtime CSMA profile
+	// are in CSMA.h.
 	#define CSMA_POST_TX_YIELD_SLOTS   3
-	#define CSMA_SLOT_MAX_MS           100
-	#define CSMA_SLOT_MIN_MS           24
-	#define CSMA_SLOT_MIN_FAST_DELTA   18
-	#define CSMA_SLOT_SYMBOLS          12
-	#define CSMA_CW_BANDS              4
 	#define CSMA_CW_MIN                0
-	#define CSMA_CW_PER_BAND_WINDOWS   15
-	#define CSMA_BAND_1_MAX_AIRTIME    7
-	#define CSMA_BAND_N_MIN_AIRTIME    85
 	#define CSMA_INFR_THRESHOLD_DB     11
 	#define CSMA_RFENV_RECAL_MS        2500
 	#define CSMA_RFENV_RECAL_LIMIT_DB -83
 	bool interference_detected      =  false;
 	bool avoid_interference         =  true;
+	csma_profile_t csma_profile     =  csma_profile_default;
+	csma_state_t csma_state         =  CSMA_STATE_INIT;
 	int csma_slot_ms                =  CSMA_SLOT_MIN_MS;
-	unsigned long difs_ms           =  CSMA_SIFS_MS + 2*csma_slot_ms;
-	unsigned long difs_wait_start   = -1;
-	unsigned long cw_wait_start     = -1;
-	unsigned long cw_wait_target    = -1;
-	unsigned long cw_wait_passed    =  0;
-	int csma_cw                     = -1;
+	unsigned long difs_ms           =  CSMA_SIFS_MS + CSMA_DIFS_SLOTS*csma_slot_ms;
 	uint8_t cw_band                 =  1;
 	uint8_t cw_min                  =  0;
 	uint8_t cw_max                  =  CSMA_CW_PER_BAND_WINDOWS;
@@ -144,6 +205,8 @@
 	bool pmu_ready     = false;
 	bool promisc       = false;
 	bool implicit      = false;
+	bool rx_ext        = false;
+	bool credits_enabled = false;
 	bool memory_low    = false;
 	uint8_t implicit_l = 0;
 
@@ -159,16 +222,51 @@
 	uint8_t last_snr_raw	= 0x80;
 	uint8_t seq				= 0xFF;
 	uint16_t read_len		= 0;
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+		// Time allowed between the two parts of a split
+		// packet, updated along with the bitrate
+		#define REASM_TIMEOUT_MARGIN_MS 250
+		uint32_t reasm_timeout_ms = 1000;
+
+		// Link-layer ARQ state. The last packet sent is
+		// kept in tbuf until it has been acknowledged.
+		arq_state_t arq_state = ARQ_STATE_INIT;
+		bool     arq_enabled  = false;
+		uint8_t  arq_retries  = ARQ_RETRIES;
+		uint16_t arq_len      = 0;
+		uint32_t arq_timeout  = 1000;
+
+		// Largest packet sent split in ARQ mode. The second
+		// part then never fills a whole frame, which lets
+		// the receiver tell a retransmitted first part from
+		// a second part with the same sequence number.
+		#define ARQ_SPLIT_MAX (MTU-1)
+	#endif
+
+	#if HAS_CAD
+		// Channel activity detection state. While CAD is
+		// enabled, one scan is run per CSMA slot during
+		// channel access, and the modem status is polled
+		// less often while the queue is empty.
+		#define CAD_TIMEOUT_SYMBOLS 8
+		#define CAD_TIMEOUT_MARGIN_MS 10
+		#define CAD_IDLE_STATUS_INTERVAL_MS (5*STATUS_INTERVAL_MS)
+		bool     cad_enabled    = CSMA_CAD;
+		uint32_t cad_started    = 0;
+		uint32_t cad_scans      = 0;
+		uint32_t cad_detections = 0;
+		bool     cad_counted    = true;
+	#endif
 	uint16_t host_write_len = 0;
 
 	// Incoming packet buffer
-	uint8_t pbuf[MTU];
+	uint8_t pbuf[MTU_MAX];
 
 	// KISS command buffer
 	uint8_t cmdbuf[CMD_L];
 
 	// LoRa transmit buffer
-	uint8_t tbuf[MTU];
+	uint8_t tbuf[MTU_MAX];
 
 	uint32_t stat_rx		= 0;
 	uint32_t stat_tx		= 0;
@@ -192,6 +290,15 @@
 		float airtime = 0.0;
 		float longterm_airtime = 0.0;
 		#define current_airtime_bin(void) (millis()%AIRTIME_LONGTERM_MS)/AIRTIME_BINLEN_MS
+
+		// Airtime budgets are kept as token buckets in
+		// milliseconds of airtime, refilled at the rate
+		// of the configured limits
+		#define AIRTIME_ST_WINDOW_MS (2*AIRTIME_BINLEN_MS)
+		float st_airtime_tokens = 0.0;
+		float lt_airtime_tokens = 0.0;
+		uint32_t airtime_tokens_last = 0;
+		uint32_t airtime_wait = 0;
 	#endif
 	float st_airtime_limit = 0.0;
 	float lt_airtime_limit = 0.0;
@@ -20,12 +20,15 @@
 #include "esp_ota_ops.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_image_format.h"
 
 #elif MCU_VARIANT == MCU_NRF52
 #include "Adafruit_nRFCrypto.h"
 
-// size of chunk to retrieve from flash sector
-#define CHUNK_SIZE 128
+// size of chunk to retrieve from flash sector. The
+// CryptoCell can only DMA from RAM, so chunks are
+// staged through a word-aligned buffer in RAM.
+#define CHUNK_SIZE 2048
 
 #define END_SECTION_SIZE 256
 
@@ -37,6 +40,7 @@
 
 #define USER_DATA_START 0xED000
 
+#define IMG_CRC_START 0xFF002
 #define IMG_SIZE_START 0xFF008
 #endif
 
@@ -44,7 +48,10 @@
 
 // Forward declaration from Utilities.h
 void eeprom_update(int mapped_addr, uint8_t byte);
+void eeprom_transaction_begin();
+void eeprom_transaction_commit();
 uint8_t eeprom_read(uint32_t addr);
+uint16_t crc16(const uint8_t *data, size_t len);
 void hard_reset(void);
 
 #if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
@@ -70,6 +77,10 @@ uint8_t dev_bootloader_hash[DEV_HASH_LEN];
 uint8_t dev_firmware_hash[DEV_HASH_LEN];
 uint8_t dev_firmware_hash_target[DEV_HASH_LEN];
 
+// Size and duration of the last firmware hash run
+uint32_t dev_hash_bytes = 0;
+uint32_t dev_hash_time_us = 0;
+
 #define EEPROM_SIG_LEN 128
 uint8_t dev_eeprom_signature[EEPROM_SIG_LEN];
 
@@ -106,9 +117,11 @@ void device_validate_signature() {
 void device_save_signature() {
   device_validate_signature();
   if (dev_signature_validated) {
+    eeprom_transaction_begin();
     for (uint8_t i = 0; i < DEV_SIG_LEN; i++) {
       eeprom_update(dev_sig_addr(i), dev_sig[i]);
     }
+    eeprom_transaction_commit();
   }
 }
 
@@ -133,12 +146,11 @@ void device_load_firmware_hash() {
 }
 
 void device_save_firmware_hash() {
+  eeprom_transaction_begin();
   for (uint8_t i = 0; i < DEV_HASH_LEN; i++) {
     eeprom_update(dev_fwhash_addr(i), dev_firmware_hash_target[i]);
   }
-  #if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
-    eeprom_flush();
-  #endif
+  eeprom_transaction_commit();
   if (!fw_signature_validated) hard_reset();
 }
 
@@ -150,40 +162,146 @@ uint32_t retrieve_application_size() {
     return fw_len;
 }
 
-void calculate_region_hash(unsigned long long start, unsigned long long end, uint8_t* return_hash) {
+uint32_t hash_chunk[CHUNK_SIZE/4];
+
+void calculate_region_hash(uint32_t start, uint32_t end, uint8_t* return_hash) {
     // this function calculates the hash digest of a region of memory,
     // currently it is only designed to work for the application region
-    uint8_t chunk[CHUNK_SIZE] = {0};
-
-    // to store potential last chunk of program
-    uint8_t chunk_next[CHUNK_SIZE] = {0};
     nRFCrypto_Hash hash;
-
     hash.begin(CRYS_HASH_SHA256_mode);
 
-    uint8_t size;
+    uint32_t started = micros();
+    dev_hash_bytes = end - start;
+    while (start < end) {
+        uint32_t size = end - start;
+        if (size > CHUNK_SIZE) size = CHUNK_SIZE;
 
-    while (start < end ) {
-        const void* src = (const void*)start;
-        if (start + CHUNK_SIZE >= end) {
-            size = end - start;
-        }
-        else {
-            size = CHUNK_SIZE;
-        }
+        memcpy(hash_chunk, (const void*)start, size);
+        hash.update((uint8_t*)hash_chunk, size);
+        start += size;
+    }
+    hash.end(return_hash);
+    dev_hash_time_us = micros() - started;
+}
+#endif
 
-        memcpy(chunk, src, CHUNK_SIZE);
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+// Computed partition hashes are cached in RAM that
+// survives warm resets, keyed on the layout of the
+// running image and the firmware build. Cold boots
+// always rehash, and so does every warm boot after
+// FW_HASH_CACHE_MAX_BOOTS consecutive cache hits.
+// Brownout resets keep RTC memory, and a cache that
+// did not survive one intact fails its CRC check.
+#define FW_HASH_CACHE_MAGIC 0x46574843
+#define FW_BUILD_ID_LEN 8
+
+typedef struct {
+  uint32_t magic;
+  uint32_t app_start;
+  uint32_t app_size;
+  uint8_t  build_id[FW_BUILD_ID_LEN];
+  uint16_t boots;
+  uint8_t  partition_table_hash[DEV_HASH_LEN];
+  uint8_t  bootloader_hash[DEV_HASH_LEN];
+  uint8_t  firmware_hash[DEV_HASH_LEN];
+  uint16_t crc;
+} __attribute__((packed)) fw_hash_cache_t;
 
-        hash.update(chunk, size);
+#if MCU_VARIANT == MCU_ESP32
+  RTC_NOINIT_ATTR fw_hash_cache_t fw_hash_cache;
+#elif MCU_VARIANT == MCU_NRF52
+  fw_hash_cache_t fw_hash_cache __attribute__ ((section(".noinit")));
+#endif
 
-        start += CHUNK_SIZE;
+fw_hash_cache_t fw_hash_key;
+
+void device_hash_cache_key() {
+  memset(&fw_hash_key, 0x00, sizeof(fw_hash_key));
+  fw_hash_key.magic = FW_HASH_CACHE_MAGIC;
+  #if MCU_VARIANT == MCU_ESP32
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    fw_hash_key.app_start = running->address;
+    fw_hash_key.app_size  = running->size;
+    memcpy(fw_hash_key.build_id, esp_ota_get_app_description()->app_elf_sha256, FW_BUILD_ID_LEN);
+  #elif MCU_VARIANT == MCU_NRF52
+    // The bootloader stores a CRC of the whole image
+    // when it is flashed. It is combined with checksums
+    // of the vector table, the middle and the end of the
+    // image, in case the bootloader left it empty.
+    uint32_t app_size = retrieve_application_size();
+    uint32_t sections[3] = { APPLICATION_START, APPLICATION_START+app_size/2, APPLICATION_START+app_size-END_SECTION_SIZE };
+    fw_hash_key.app_start = APPLICATION_START;
+    fw_hash_key.app_size  = app_size;
+    memcpy(fw_hash_key.build_id, (const void*)IMG_CRC_START, 2);
+    bool app_valid = app_size >= END_SECTION_SIZE && app_size <= USER_DATA_START-APPLICATION_START;
+    for (uint8_t i = 0; i < 3; i++) {
+      uint16_t section_crc = 0;
+      if (app_valid) { section_crc = crc16((const uint8_t*)sections[i], END_SECTION_SIZE); }
+      fw_hash_key.build_id[2+i*2] = section_crc >> 8;
+      fw_hash_key.build_id[3+i*2] = section_crc & 0xFF;
     }
-    hash.end(return_hash);
+  #endif
+}
+
+bool device_hash_cache_load() {
+  #if FW_HASH_CACHE
+    #if MCU_VARIANT == MCU_ESP32
+      esp_reset_reason_t reason = esp_reset_reason();
+      if (reason == ESP_RST_POWERON) return false;
+    #endif
+
+    fw_hash_cache_t* c = &fw_hash_cache;
+    if (c->magic != FW_HASH_CACHE_MAGIC) return false;
+    if (c->crc != crc16((const uint8_t*)c, offsetof(fw_hash_cache_t, crc))) return false;
+    if (c->app_start != fw_hash_key.app_start || c->app_size != fw_hash_key.app_size) return false;
+    if (memcmp(c->build_id, fw_hash_key.build_id, FW_BUILD_ID_LEN) != 0) return false;
+    if (c->boots >= FW_HASH_CACHE_MAX_BOOTS) return false;
+
+    memcpy(dev_partition_table_hash, c->partition_table_hash, DEV_HASH_LEN);
+    memcpy(dev_bootloader_hash, c->bootloader_hash, DEV_HASH_LEN);
+    memcpy(dev_firmware_hash, c->firmware_hash, DEV_HASH_LEN);
+    c->boots++;
+    c->crc = crc16((const uint8_t*)c, offsetof(fw_hash_cache_t, crc));
+    return true;
+  #else
+    return false;
+  #endif
+}
+
+void device_hash_cache_store() {
+  #if FW_HASH_CACHE
+    fw_hash_cache_t* c = &fw_hash_cache;
+    memcpy(c, &fw_hash_key, sizeof(fw_hash_cache_t));
+    c->boots = 0;
+    memcpy(c->partition_table_hash, dev_partition_table_hash, DEV_HASH_LEN);
+    memcpy(c->bootloader_hash, dev_bootloader_hash, DEV_HASH_LEN);
+    memcpy(c->firmware_hash, dev_firmware_hash, DEV_HASH_LEN);
+    c->crc = crc16((const uint8_t*)c, offsetof(fw_hash_cache_t, crc));
+  #endif
 }
 #endif
 
-void device_validate_partitions() {
-  device_load_firmware_hash();
+void device_hash_firmware() {
+  #if MCU_VARIANT == MCU_ESP32
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_partition_pos_t running_pos = { .offset = running->address, .size = running->size };
+  esp_image_metadata_t running_meta;
+  if (esp_image_get_metadata(&running_pos, &running_meta) == ESP_OK) {
+    dev_hash_bytes = running_meta.image_len;
+  } else {
+    dev_hash_bytes = running->size;
+  }
+
+  uint32_t started = micros();
+  esp_partition_get_sha256(running, dev_firmware_hash);
+  dev_hash_time_us = micros() - started;
+  #elif MCU_VARIANT == MCU_NRF52
+  calculate_region_hash(APPLICATION_START, APPLICATION_START+retrieve_application_size(), dev_firmware_hash);
+  #endif
+}
+
+void device_hash_partitions() {
   #if MCU_VARIANT == MCU_ESP32
   esp_partition_t partition;
   partition.address   = ESP_PARTITION_TABLE_OFFSET;
@@ -194,11 +312,13 @@ void device_validate_partitions() {
   partition.size      = ESP_PARTITION_TABLE_OFFSET;
   partition.type      = ESP_PARTITION_TYPE_APP;
   esp_partition_get_sha256(&partition, dev_bootloader_hash);
-  esp_partition_get_sha256(esp_ota_get_running_partition(), dev_firmware_hash);
   #elif MCU_VARIANT == MCU_NRF52
   // todo, add bootloader, partition table, or softdevice?
-  calculate_region_hash(APPLICATION_START, APPLICATION_START+retrieve_application_size(), dev_firmware_hash);
   #endif
+  device_hash_firmware();
+}
+
+void device_check_firmware_hash() {
   #if VALIDATE_FIRMWARE
     for (uint8_t i = 0; i < DEV_HASH_LEN; i++) {
       if (dev_firmware_hash_target[i] != dev_firmware_hash[i]) {
@@ -209,6 +329,88 @@ void device_validate_partitions() {
   #endif
 }
 
+#if FW_VALIDATION_DEFERRED
+  #define FW_VALIDATION_IDLE    0x00
+  #define FW_VALIDATION_PENDING 0x01
+  #define FW_VALIDATION_RUNNING 0x02
+  #define FW_VALIDATION_DONE    0x03
+
+  #if MCU_VARIANT == MCU_ESP32
+    #define FW_VALIDATION_STACK 4096
+  #elif MCU_VARIANT == MCU_NRF52
+    #define FW_VALIDATION_STACK 512
+  #endif
+
+  volatile uint8_t fw_validation_state = FW_VALIDATION_IDLE;
+
+  void device_deferred_validate() {
+    #if MCU_VARIANT == MCU_NRF52
+      nRFCrypto.begin();
+    #endif
+    device_hash_partitions();
+    #if MCU_VARIANT == MCU_NRF52
+      nRFCrypto.end();
+    #endif
+    device_hash_cache_store();
+    device_check_firmware_hash();
+    fw_validation_state = FW_VALIDATION_DONE;
+  }
+
+  void device_validation_task(void* param) {
+    device_deferred_validate();
+    vTaskDelete(NULL);
+  }
+
+  // Starts partition hashing in a low priority task
+  // if device_init() deferred it. Should be called
+  // once the radio is up, so that hashing does not
+  // delay the device becoming operational.
+  void device_start_deferred_validation() {
+    if (fw_validation_state == FW_VALIDATION_PENDING) {
+      fw_validation_state = FW_VALIDATION_RUNNING;
+      if (xTaskCreate(device_validation_task, "fw_validate", FW_VALIDATION_STACK, NULL, 1, NULL) != pdPASS) {
+        // Fall back to validating in the foreground
+        device_deferred_validate();
+      }
+    }
+  }
+#endif
+
+void device_validate_partitions() {
+  device_load_firmware_hash();
+  device_hash_cache_key();
+  if (!device_hash_cache_load()) {
+    #if FW_VALIDATION_DEFERRED
+      // Firmware is provisionally trusted until the
+      // background validation task has completed
+      fw_validation_state = FW_VALIDATION_PENDING;
+      return;
+    #else
+      device_hash_partitions();
+      device_hash_cache_store();
+    #endif
+  }
+  device_check_firmware_hash();
+}
+
+// Rehashes the running firmware on request, so hash
+// reports reflect flash contents rather than values
+// computed at boot.
+bool device_rehash_firmware() {
+  #if FW_VALIDATION_DEFERRED
+    if (fw_validation_state == FW_VALIDATION_PENDING || fw_validation_state == FW_VALIDATION_RUNNING) return false;
+  #endif
+  #if MCU_VARIANT == MCU_NRF52
+    nRFCrypto.begin();
+  #endif
+  device_hash_firmware();
+  #if MCU_VARIANT == MCU_NRF52
+    nRFCrypto.end();
+  #endif
+  device_hash_cache_store();
+  return true;
+}
+
 bool device_firmware_ok() {
   return fw_signature_validated;
 }
@@ -325,45 +325,25 @@ bool display_init() {
       Wire.begin(SDA_OLED, SCL_OLED);
     #endif
 
-    #if HAS_EEPROM
-      uint8_t display_rotation = EEPROM.read(eeprom_addr(ADDR_CONF_DROT));
-    #elif MCU_VARIANT == MCU_NRF52
-      uint8_t display_rotation = eeprom_read(eeprom_addr(ADDR_CONF_DROT));
-    #endif
+    uint8_t display_rotation = device_config.disp_rot;
     if (display_rotation < 0 or display_rotation > 3) display_rotation = 0xFF;
 
     #if DISP_CUSTOM_ADDR == true
-      #if HAS_EEPROM
-        uint8_t display_address = EEPROM.read(eeprom_addr(ADDR_CONF_DADR));
-      #elif MCU_VARIANT == MCU_NRF52
-        uint8_t display_address = eeprom_read(eeprom_addr(ADDR_CONF_DADR));
-      #endif
+      uint8_t display_address = device_config.disp_addr;
       if (display_address == 0xFF) display_address = DISP_ADDR;
     #else
       uint8_t display_address = DISP_ADDR;
     #endif
 
-    #if HAS_EEPROM
-      if (EEPROM.read(eeprom_addr(ADDR_CONF_BSET)) == CONF_OK_BYTE) {
-        uint8_t db_timeout = EEPROM.read(eeprom_addr(ADDR_CONF_DBLK));
-        if (db_timeout == 0x00) {
-          display_blanking_enabled = false;
-        } else {
-          display_blanking_enabled = true;
-          display_blanking_timeout = db_timeout*1000;
-        }
-      }
-    #elif MCU_VARIANT == MCU_NRF52
-      if (eeprom_read(eeprom_addr(ADDR_CONF_BSET)) == CONF_OK_BYTE) {
-        uint8_t db_timeout = eeprom_read(eeprom_addr(ADDR_CONF_DBLK));
-        if (db_timeout == 0x00) {
-          display_blanking_enabled = false;
-        } else {
-          display_blanking_enabled = true;
-          display_blanking_timeout = db_timeout*1000;
-        }
+    if (device_config.disp_blank_set == CONF_OK_BYTE) {
+      uint8_t db_timeout = device_config.disp_blank;
+      if (db_timeout == 0x00) {
+        display_blanking_enabled = false;
+      } else {
+        display_blanking_enabled = true;
+        display_blanking_timeout = db_timeout*1000;
       }
-    #endif
+    }
     
     #if BOARD_MODEL == BOARD_TECHO
     // Don't check if display is actually connected
@@ -453,11 +433,7 @@ bool display_init() {
       display.cp437(true);
       #endif
 
-      #if HAS_EEPROM
-        display_intensity = EEPROM.read(eeprom_addr(ADDR_CONF_DINT));
-      #elif MCU_VARIANT == MCU_NRF52
-        display_intensity = eeprom_read(eeprom_addr(ADDR_CONF_DINT));
-      #endif
+      display_intensity = device_config.disp_int;
       display_unblank_intensity = display_intensity;
 
       #if BOARD_MODEL == BOARD_TECHO
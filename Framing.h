@@ -37,6 +37,16 @@
   #define CMD_LT_ALOCK    0x0C
   #define CMD_PROMISC     0x0E
   #define CMD_READY       0x0F
+  #define CMD_DATA_BATCH  0x10
+  #define CMD_DATA_EXT    0x11
+  #define CMD_CREDITS     0x12
+  #define CMD_DATA_PRIO   0x13
+  #define CMD_QUEUE_TTL   0x14
+  #define CMD_CSMA_PROF   0x15
+  #define CMD_FRAG_MODE   0x16
+  #define CMD_AGGREGATE   0x17
+  #define CMD_ARQ         0x18
+  #define CMD_CAD         0x19
 
   #define CMD_STAT_RX     0x21
   #define CMD_STAT_TX     0x22
@@ -47,6 +57,8 @@
   #define CMD_STAT_BAT    0x27
   #define CMD_STAT_CSMA   0x28
   #define CMD_STAT_TEMP   0x29
+  #define CMD_STAT_QUEUE  0x2A
+  #define CMD_STAT_ATBGT  0x2B
   #define CMD_BLINK       0x30
   #define CMD_RANDOM      0x40
 
@@ -64,6 +76,7 @@
   #define CMD_BT_CTRL     0x46
   #define CMD_BT_UNPAIR   0x70
   #define CMD_BT_PIN      0x62
+  #define CMD_BT_LINK     0x71
   #define CMD_DIS_IA      0x69
   #define CMD_WIFI_MODE   0x6A
   #define CMD_WIFI_SSID   0x6B
@@ -71,6 +84,8 @@
   #define CMD_WIFI_CHN    0x6E
   #define CMD_WIFI_IP     0x84
   #define CMD_WIFI_NM     0x85
+  #define CMD_WIFI_TRSP   0x86
+  #define CMD_WIFI_PEER   0x87
 
   #define CMD_BOARD       0x47
   #define CMD_PLATFORM    0x48
@@ -105,6 +120,9 @@
   #define NIBBLE_SEQ      0xF0
   #define NIBBLE_FLAGS    0x0F
   #define FLAG_SPLIT      0x01
+  #define FLAG_FRAG       0x02
+  #define FLAG_AGGR       0x04
+  #define FLAG_ARQ        0x08
   #define SEQ_UNSET       0xFF
 
   #define CMD_ERROR           0x90
@@ -115,6 +133,20 @@
   #define ERROR_MEMORY_LOW    0x05
   #define ERROR_MODEM_TIMEOUT 0x06
 
+  #define BATCH_OK            0x00
+  #define BATCH_FULL          0x01
+  #define BATCH_MALFORMED     0x02
+
+  #define TX_PRIO_HIGH        0x00
+  #define TX_PRIO_NORMAL      0x01
+  #define TX_PRIO_BULK        0x02
+  #define TX_PRIO_ALL         0xFF
+
+  #define CSMA_PROF_READ      0x00
+  #define CSMA_PROF_SET       0x01
+  #define CSMA_PROF_SAVE      0x02
+  #define CSMA_PROF_RESET     0x03
+
   // Serial framing variables
   size_t frame_len;
   bool IN_FRAME = false;
@@ -47,14 +47,33 @@ class KISS():
     CMD_DETECT      = 0x08
     CMD_PROMISC     = 0x0E
     CMD_READY       = 0x0F
+    CMD_DATA_BATCH  = 0x10
+    CMD_DATA_EXT    = 0x11
+    CMD_CREDITS     = 0x12
+    CMD_DATA_PRIO   = 0x13
+    CMD_QUEUE_TTL   = 0x14
+    CMD_CSMA_PROF   = 0x15
+    CMD_FRAG_MODE   = 0x16
+    CMD_AGGREGATE   = 0x17
+    CMD_ARQ         = 0x18
+    CMD_CAD         = 0x19
+    RX_EXT_OVERHEAD = 10
     CMD_STAT_RX     = 0x21
     CMD_STAT_TX     = 0x22
     CMD_STAT_RSSI   = 0x23
     CMD_STAT_SNR    = 0x24
+    CMD_STAT_QUEUE  = 0x2A
+    CMD_STAT_ATBGT  = 0x2B
     CMD_BLINK       = 0x30
     CMD_RANDOM      = 0x40
     CMD_FW_VERSION  = 0x50
     CMD_ROM_READ    = 0x51
+    CMD_BT_LINK     = 0x71
+    CMD_LOG         = 0x80
+
+    LOG_BOOT_TRACE  = 0x01
+    BOOT_PHASES     = ["start", "eeprom", "config", "serial", "modem", "display", "pmu",
+                       "bluetooth", "wifi", "device_init", "radio", "status", "done"]
 
     DETECT_REQ      = 0x73
     DETECT_RESP     = 0x46
@@ -68,6 +87,23 @@ class KISS():
     ERROR_TXFAILED      = 0x02
     ERROR_EEPROM_LOCKED = 0x03
 
+    BATCH_OK            = 0x00
+    BATCH_FULL          = 0x01
+    BATCH_MALFORMED     = 0x02
+
+    TX_PRIO_HIGH        = 0x00
+    TX_PRIO_NORMAL      = 0x01
+    TX_PRIO_BULK        = 0x02
+    TX_PRIO_ALL         = 0xFF
+
+    CSMA_PROF_READ      = 0x00
+    CSMA_PROF_SET       = 0x01
+    CSMA_PROF_SAVE      = 0x02
+    CSMA_PROF_RESET     = 0x03
+
+    CSMA_PROFILE_FIELDS = ["slot_min_ms", "slot_max_ms", "slot_symbols", "cw_bands", "cw_per_band",
+                           "band_1_max_airtime", "band_n_min_airtime", "sifs_ms", "difs_slots"]
+
     @staticmethod
     def escape(data):
         data = data.replace(bytes([0xdb]), bytes([0xdb, 0xdd]))
@@ -95,6 +131,10 @@ class RNodeInterface():
 
     RSSI_OFFSET = 157
 
+    # Sent in extended RX frames by modems that cannot
+    # measure the frequency error (SX126x and SX128x)
+    FREQ_ERR_UNAVAILABLE = -0x80000000
+
     CALLSIGN_MAX_LEN    = 32
 
     def __init__(self, callback, name, port, frequency = None, bandwidth = None, txpower = None, sf = None, cr = None, loglevel = LOG_NOTICE, flow_control = False, id_interval = None, id_callsign = None):
@@ -132,11 +172,34 @@ class RNodeInterface():
         self.r_stat_rssi = None
         self.r_stat_snr  = None
         self.r_random    = None
+        self.r_bt_link   = None
+        self.r_boot_trace = []
+        self.r_batch      = None
+        self.r_rx_ext     = None
+        self.r_freq_err   = None
+        self.r_rx_time    = None
+        self.r_queue_stats = None
+        self.r_airtime_budget = None
+        self.r_csma_profile = None
+        self.r_frag_mode    = None
+        self.r_aggregate    = None
+        self.r_arq          = None
+        self.r_cad          = None
+        self.mtu            = RNodeInterface.MTU
+
+        self.poll_interval = 0.08
+        self.detect_event  = threading.Event()
 
         self.packet_queue    = []
         self.flow_control    = flow_control
         self.interface_ready = False
 
+        self.credit_flow        = False
+        self.credit_slots       = 0
+        self.credit_bytes       = 0
+        self.credit_inflight    = []
+        self.credit_frames_sent = 0
+
         self.validcfg  = True
         if (self.frequency < RNodeInterface.FREQ_MIN or self.frequency > RNodeInterface.FREQ_MAX):
             self.log("Invalid frequency configured for "+str(self), RNodeInterface.LOG_ERROR)
@@ -308,6 +371,52 @@ class RNodeInterface():
             raise IOError("An IO error occurred while configuring promiscuous mode for "+self(str))
 
 
+    def requestBTLink(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_BT_LINK, 0xFF, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting BLE link parameters for "+self(str))
+
+    def setBTLink(self, interval_min, interval_max, latency=0, timeout=400, dle=True, phy_2m=True, coalesce=False):
+        # Intervals are in units of 1.25 ms, timeout in units of 10 ms.
+        # Coalescing lets KISS frames share BLE notifications on nRF52.
+        opts = (0x01 if dle else 0x00) | (0x02 if phy_2m else 0x00) | (0x04 if coalesce else 0x00)
+        data = interval_min.to_bytes(2, "big")+interval_max.to_bytes(2, "big")+latency.to_bytes(2, "big")+timeout.to_bytes(2, "big")+bytes([opts])
+        kiss_command = bytes([KISS.FEND, KISS.CMD_BT_LINK])+KISS.escape(data)+bytes([KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring BLE link parameters for "+self(str))
+
+    def requestBootTrace(self):
+        self.r_boot_trace = []
+        kiss_command = bytes([KISS.FEND, KISS.CMD_LOG, KISS.LOG_BOOT_TRACE, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting boot trace for "+self(str))
+
+    def measureLatency(self, count=10, timeout=2.0):
+        # Sends detect probes and times the responses, which
+        # gives the host-to-device round trip over whatever
+        # transport the device is connected through.
+        samples = []
+        poll_interval = self.poll_interval
+        self.poll_interval = 0.001
+        try:
+            for i in range(count):
+                self.detect_event.clear()
+                started = time.time()
+                kiss_command = bytes([KISS.FEND, KISS.CMD_DETECT, KISS.DETECT_REQ, KISS.FEND])
+                self.serial.write(kiss_command)
+                if self.detect_event.wait(timeout):
+                    samples.append((time.time()-started)*1000)
+        finally:
+            self.poll_interval = poll_interval
+
+        if len(samples) == 0:
+            return None
+        samples.sort()
+        return {"count": len(samples), "lost": count-len(samples), "min": samples[0], "median": samples[len(samples)//2], "max": samples[-1]}
+
     def updateBitrate(self):
         try:
             self.bitrate = self.r_sf * ( (4.0/self.r_cr) / (math.pow(2,self.r_sf)/(self.r_bandwidth/1000)) ) * 1000
@@ -323,7 +432,13 @@ class RNodeInterface():
         self.processOutgoing(data)
 
     def processOutgoing(self,data):
-        if self.online:
+        if self.online and self.credit_flow:
+            if len(self.packet_queue) == 0 and self.creditsAvailable(len(data)):
+                self.writeCredited(data)
+            else:
+                self.queue(data)
+
+        elif self.online:
             if self.interface_ready:
                 if self.flow_control:
                     self.interface_ready = False
@@ -344,6 +459,188 @@ class RNodeInterface():
             else:
                 self.queue(data)
 
+    def enableCredits(self, enabled=True):
+        # With credit flow control, the device pushes its free
+        # queue slots and bytes, and the host pipelines packets
+        # up to that limit instead of waiting for CMD_READY.
+        self.credit_flow = enabled
+        self.credit_inflight = []
+        kiss_command = bytes([KISS.FEND, KISS.CMD_CREDITS, 0x01 if enabled else 0x00, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring credit flow control for "+self(str))
+
+    def creditsAvailable(self, length, packets=1):
+        slots = self.credit_slots - sum(f[0] for f in self.credit_inflight)
+        octets = self.credit_bytes - sum(f[1] for f in self.credit_inflight)
+        return slots >= packets and octets >= length
+
+    def creditFrameSent(self, packets, length):
+        self.credit_inflight.append((packets, length))
+        self.credit_frames_sent = (self.credit_frames_sent+1) & 0xFFFF
+
+    def creditUpdate(self, slots, octets, frames):
+        # Frames the device has not processed yet at the time
+        # of the report are still charged against the credits
+        in_flight = (self.credit_frames_sent - frames) & 0xFFFF
+        self.credit_inflight = self.credit_inflight[-in_flight:] if in_flight > 0 else []
+        self.credit_slots = slots
+        self.credit_bytes = octets
+        while len(self.packet_queue) > 0 and self.creditsAvailable(len(self.packet_queue[0])):
+            self.writeCredited(self.packet_queue.pop(0))
+
+    def writeCredited(self, data):
+        frame = b""
+        if self.id_interval != None and self.id_callsign != None:
+            if self.last_id + self.id_interval < time.time():
+                self.last_id = time.time()
+                callsign = self.id_callsign.encode("utf-8")
+                frame = bytes([0xc0])+bytes([0x00])+KISS.escape(callsign)+bytes([0xc0])
+                self.creditFrameSent(1, len(callsign))
+
+        frame  += bytes([0xc0])+bytes([0x00])+KISS.escape(data)+bytes([0xc0])
+        self.creditFrameSent(1, len(data))
+        written = self.serial.write(frame)
+        if written != len(frame):
+            raise IOError("Serial interface only wrote "+str(written)+" bytes of "+str(len(frame)))
+
+    def setExtendedRX(self, enabled):
+        # With extended RX enabled, received packets arrive as
+        # CMD_DATA_EXT frames with RSSI, SNR, frequency error
+        # and device timestamp inline, instead of separate
+        # stat frames followed by CMD_DATA.
+        kiss_command = bytes([KISS.FEND, KISS.CMD_DATA_EXT, 0x01 if enabled else 0x00, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring extended RX for "+self(str))
+
+    def sendPriority(self, data, priority=KISS.TX_PRIO_NORMAL):
+        # Queues a packet in one of the device transmit
+        # priority classes, bypassing host side queueing
+        frame   = bytes([KISS.FEND, KISS.CMD_DATA_PRIO])+KISS.escape(bytes([priority])+data)+bytes([KISS.FEND])
+        written = self.serial.write(frame)
+        if written != len(frame):
+            raise IOError("Serial interface only wrote "+str(written)+" bytes of "+str(len(frame)))
+
+    def requestQueueStats(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_STAT_QUEUE, 0x00, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting queue statistics for "+self(str))
+
+    def setQueueTTL(self, ttl_ms, priority=KISS.TX_PRIO_ALL):
+        # Packets that have been queued on the device for
+        # longer than this are dropped instead of sent.
+        # A TTL of zero disables expiry for the class.
+        ttl = int(ttl_ms) & 0xFFFFFFFF
+        data = KISS.escape(bytes([priority])+ttl.to_bytes(4, "big"))
+        kiss_command = bytes([KISS.FEND, KISS.CMD_QUEUE_TTL])+data+bytes([KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring queue TTL for "+self(str))
+
+    def setCSMAProfile(self, profile, save=False):
+        # Sets the contention parameters used by the device.
+        # Fields missing from the profile keep their current
+        # values, so the profile must have been read first.
+        current = self.r_csma_profile or {}
+        values = []
+        for field in KISS.CSMA_PROFILE_FIELDS:
+            value = profile[field] if field in profile else current.get(field, None)
+            if value == None:
+                raise ValueError("No value for CSMA profile field "+field)
+            values.append(int(value) & 0xFF)
+
+        op = KISS.CSMA_PROF_SAVE if save else KISS.CSMA_PROF_SET
+        data = KISS.escape(bytes([op]+values))
+        kiss_command = bytes([KISS.FEND, KISS.CMD_CSMA_PROF])+data+bytes([KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring CSMA profile for "+self(str))
+
+    def resetCSMAProfile(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_CSMA_PROF, KISS.CSMA_PROF_RESET, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while resetting CSMA profile for "+self(str))
+
+    def setFragmentation(self, enabled):
+        if enabled:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_FRAG_MODE, 0x01, KISS.FEND])
+        else:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_FRAG_MODE, 0x00, KISS.FEND])
+
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring fragmentation for "+self(str))
+
+    def setAggregation(self, window_ms):
+        window_ms = max(0, min(0xFFFF, int(window_ms)))
+        data = KISS.escape(window_ms.to_bytes(2, "big"))
+        kiss_command = bytes([KISS.FEND, KISS.CMD_AGGREGATE])+data+bytes([KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring aggregation for "+self(str))
+
+    def setARQ(self, enabled, retries=3):
+        retries = max(0, min(15, int(retries)))
+        if enabled:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_ARQ, 0x01, retries, KISS.FEND])
+        else:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_ARQ, 0x00, retries, KISS.FEND])
+
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring ARQ for "+self(str))
+
+    def requestARQ(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_ARQ, 0xFF, 0x00, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting ARQ state for "+self(str))
+
+    def setCAD(self, enabled):
+        if enabled:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_CAD, 0x01, KISS.FEND])
+        else:
+            kiss_command = bytes([KISS.FEND, KISS.CMD_CAD, 0x00, KISS.FEND])
+
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while configuring CAD for "+self(str))
+
+    def requestCAD(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_CAD, 0xFF, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting CAD state for "+self(str))
+
+    def requestCSMAProfile(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_CSMA_PROF, KISS.CSMA_PROF_READ, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting CSMA profile for "+self(str))
+
+    def requestAirtimeBudget(self):
+        kiss_command = bytes([KISS.FEND, KISS.CMD_STAT_ATBGT, 0x00, KISS.FEND])
+        written = self.serial.write(kiss_command)
+        if written != len(kiss_command):
+            raise IOError("An IO error occurred while requesting airtime budget for "+self(str))
+
+    def sendBatch(self, packets):
+        # Sends several packets in one frame. The device
+        # queues either all of them or none, and reports
+        # the outcome in a CMD_DATA_BATCH response.
+        payload = b""
+        for data in packets:
+            payload += len(data).to_bytes(2, "big")+data
+        frame   = bytes([KISS.FEND, KISS.CMD_DATA_BATCH])+KISS.escape(payload)+bytes([KISS.FEND])
+        if self.credit_flow:
+            self.creditFrameSent(len(packets), len(payload)-2*len(packets))
+        written = self.serial.write(frame)
+        if written != len(frame):
+            raise IOError("Serial interface only wrote "+str(written)+" bytes of "+str(len(frame)))
+
     def queue(self, data):
         self.packet_queue.append(data)
 
@@ -374,15 +671,29 @@ class RNodeInterface():
                         self.processIncoming(data_buffer)
                         data_buffer = b""
                         command_buffer = b""
+                    elif (in_frame and byte == KISS.FEND and command == KISS.CMD_DATA_EXT):
+                        in_frame = False
+                        if len(data_buffer) == 1:
+                            self.r_rx_ext = data_buffer[0] == 0x01
+                        elif len(data_buffer) > KISS.RX_EXT_OVERHEAD:
+                            b = data_buffer
+                            self.r_stat_rssi = b[0]-RNodeInterface.RSSI_OFFSET
+                            self.r_stat_snr  = int.from_bytes(bytes([b[1]]), byteorder="big", signed=True) * 0.25
+                            self.r_freq_err  = int.from_bytes(b[2:6], byteorder="big", signed=True)
+                            if self.r_freq_err == RNodeInterface.FREQ_ERR_UNAVAILABLE: self.r_freq_err = None
+                            self.r_rx_time   = int.from_bytes(b[6:10], byteorder="big")
+                            self.processIncoming(data_buffer[KISS.RX_EXT_OVERHEAD:])
+                        data_buffer = b""
+                        command_buffer = b""
                     elif (byte == KISS.FEND):
                         in_frame = True
                         command = KISS.CMD_UNKNOWN
                         data_buffer = b""
                         command_buffer = b""
-                    elif (in_frame and len(data_buffer) < RNodeInterface.MTU):
+                    elif (in_frame and len(data_buffer) < self.mtu+KISS.RX_EXT_OVERHEAD):
                         if (len(data_buffer) == 0 and command == KISS.CMD_UNKNOWN):
                             command = byte
-                        elif (command == KISS.CMD_DATA):
+                        elif (command == KISS.CMD_DATA or command == KISS.CMD_DATA_EXT):
                             if (byte == KISS.FESC):
                                 escape = True
                             else:
@@ -483,6 +794,200 @@ class RNodeInterface():
                                 self.log(str(self)+" hardware error (code "+RNS.hexrep(byte)+")", RNodeInterface.LOG_ERROR)
                         elif (command == KISS.CMD_READY):
                             self.process_queue()
+                        elif (command == KISS.CMD_DETECT):
+                            if (byte == KISS.DETECT_RESP):
+                                self.detect_event.set()
+                        elif (command == KISS.CMD_BT_LINK):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 16):
+                                    b = command_buffer
+                                    self.r_bt_link = {
+                                        "interval": (b[0] << 8 | b[1])*1.25,
+                                        "latency": b[2] << 8 | b[3],
+                                        "timeout": (b[4] << 8 | b[5])*10,
+                                        "mtu": b[6] << 8 | b[7],
+                                        "data_length": b[8] << 8 | b[9],
+                                        "phy": "2M" if b[10] == 0x02 else "1M",
+                                        "options": b[11],
+                                        "rx_overflows": int.from_bytes(b[12:16], "big"),
+                                    }
+                                    self.log(str(self)+" BLE link interval "+str(self.r_bt_link["interval"])+" ms, latency "+str(self.r_bt_link["latency"])+", MTU "+str(self.r_bt_link["mtu"])+", PHY "+self.r_bt_link["phy"], RNodeInterface.LOG_DEBUG)
+                        elif (command == KISS.CMD_STAT_QUEUE):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 1+command_buffer[0]*27):
+                                    stats = []
+                                    for i in range(command_buffer[0]):
+                                        b = command_buffer[1+i*27:1+(i+1)*27]
+                                        stats.append({
+                                            "class": b[0], "packets": b[1], "max_packets": b[2],
+                                            "bytes": b[3] << 8 | b[4], "max_bytes": b[5] << 8 | b[6],
+                                            "queued": int.from_bytes(b[7:11], "big"),
+                                            "sent": int.from_bytes(b[11:15], "big"),
+                                            "dropped": int.from_bytes(b[15:19], "big"),
+                                            "expired": int.from_bytes(b[19:23], "big"),
+                                            "ttl": int.from_bytes(b[23:27], "big"),
+                                        })
+                                    self.r_queue_stats = stats
+                        elif (command == KISS.CMD_CSMA_PROF):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == len(KISS.CSMA_PROFILE_FIELDS)+1):
+                                    profile = dict(zip(KISS.CSMA_PROFILE_FIELDS, command_buffer[:-1]))
+                                    profile["saved"] = command_buffer[-1] == 0x01
+                                    self.r_csma_profile = profile
+                        elif (command == KISS.CMD_FRAG_MODE):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 4):
+                                    self.r_frag_mode = {
+                                        "enabled": command_buffer[0] == 0x01,
+                                        "max_segments": command_buffer[1],
+                                        "mtu": int.from_bytes(command_buffer[2:4], "big"),
+                                    }
+                                    self.mtu = self.r_frag_mode["mtu"]
+                        elif (command == KISS.CMD_AGGREGATE):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 2):
+                                    self.r_aggregate = {"window_ms": int.from_bytes(command_buffer[0:2], "big")}
+                        elif (command == KISS.CMD_ARQ):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 18):
+                                    b = command_buffer
+                                    self.r_arq = {
+                                        "enabled": b[0] == 0x01,
+                                        "retries": b[1],
+                                        "acked": int.from_bytes(b[2:6], "big"),
+                                        "retransmits": int.from_bytes(b[6:10], "big"),
+                                        "failed": int.from_bytes(b[10:14], "big"),
+                                        "duplicates": int.from_bytes(b[14:18], "big"),
+                                    }
+                        elif (command == KISS.CMD_CAD):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 10):
+                                    b = command_buffer
+                                    self.r_cad = {
+                                        "enabled": b[0] == 0x01,
+                                        "available": b[1] == 0x01,
+                                        "scans": int.from_bytes(b[2:6], "big"),
+                                        "detections": int.from_bytes(b[6:10], "big"),
+                                    }
+                        elif (command == KISS.CMD_STAT_ATBGT):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 12):
+                                    self.r_airtime_budget = {
+                                        "wait_ms": int.from_bytes(command_buffer[0:4], "big"),
+                                        "st_budget_ms": int.from_bytes(command_buffer[4:8], "big", signed=True),
+                                        "lt_budget_ms": int.from_bytes(command_buffer[8:12], "big", signed=True),
+                                    }
+                        elif (command == KISS.CMD_CREDITS):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 6):
+                                    b = command_buffer
+                                    self.creditUpdate(b[0] << 8 | b[1], b[2] << 8 | b[3], b[4] << 8 | b[5])
+                        elif (command == KISS.CMD_DATA_BATCH):
+                            command_buffer = command_buffer+bytes([byte])
+                            if (len(command_buffer) == 2):
+                                self.r_batch = {"status": command_buffer[0], "count": command_buffer[1]}
+                                if command_buffer[0] != KISS.BATCH_OK:
+                                    self.log(str(self)+" Batch rejected by device (status "+str(command_buffer[0])+")", RNodeInterface.LOG_WARNING)
+                        elif (command == KISS.CMD_LOG):
+                            if (byte == KISS.FESC):
+                                escape = True
+                            else:
+                                if (escape):
+                                    if (byte == KISS.TFEND):
+                                        byte = KISS.FEND
+                                    if (byte == KISS.TFESC):
+                                        byte = KISS.FESC
+                                    escape = False
+                                command_buffer = command_buffer+bytes([byte])
+                                if (len(command_buffer) == 6 and command_buffer[0] == KISS.LOG_BOOT_TRACE):
+                                    b = command_buffer
+                                    phase = b[1]
+                                    ms = b[2] << 24 | b[3] << 16 | b[4] << 8 | b[5]
+                                    name = KISS.BOOT_PHASES[phase] if phase < len(KISS.BOOT_PHASES) else str(phase)
+                                    if phase == 0: self.r_boot_trace = []
+                                    self.r_boot_trace.append((name, ms))
+                                    self.log(str(self)+" Boot phase "+name+" completed at "+str(ms)+" ms", RNodeInterface.LOG_DEBUG)
                         
                 else:
                     time_since_last = int(time.time()*1000) - last_read_ms
@@ -492,7 +997,7 @@ class RNodeInterface():
                         in_frame = False
                         command = KISS.CMD_UNKNOWN
                         escape = False
-                    sleep(0.08)
+                    sleep(self.poll_interval)
 
         except Exception as e:
             self.online = False
@@ -20,18 +20,91 @@
 FIFOBuffer serialFIFO;
 uint8_t serialBuffer[CONFIG_UART_BUFFER_SIZE+1];
 
-FIFOBuffer16 packet_starts;
-uint16_t packet_starts_buf[CONFIG_QUEUE_MAX_LENGTH+1];
+// The transmit queue is split into priority
+// classes. Each class has its own ring in
+// packet_queue and its own slice of the packet
+// start and length FIFOs, so that each class is
+// limited in both bytes and packets.
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  #define TX_CLASSES 3
+  #define TX_CLASS_DEFAULT TX_PRIO_NORMAL
+  // Share of queue bytes and slots per class, in eighths
+  const uint8_t tx_class_share[TX_CLASSES] = {1, 5, 2};
+  const uint8_t tx_class_weight[TX_CLASSES] = {4, 2, 1};
+#else
+  #define TX_CLASSES 1
+  #define TX_CLASS_DEFAULT 0
+  const uint8_t tx_class_share[TX_CLASSES] = {8};
+  const uint8_t tx_class_weight[TX_CLASSES] = {1};
+#endif
 
-FIFOBuffer16 packet_lengths;
-uint16_t packet_lengths_buf[CONFIG_QUEUE_MAX_LENGTH+1];
+typedef struct {
+  uint16_t base;
+  uint16_t size;
+  uint16_t cursor;
+  uint16_t current_start;
+  uint16_t pending;
+  uint16_t bytes;
+  uint8_t  height;
+  uint8_t  max_height;
+  bool     overflow;
+  FIFOBuffer16 starts;
+  FIFOBuffer16 lengths;
+  uint32_t *queued_at;
+  uint32_t ttl;
+  uint32_t stat_queued;
+  uint32_t stat_sent;
+  uint32_t stat_dropped;
+  uint32_t stat_expired;
+} tx_class_t;
+
+tx_class_t tx_classes[TX_CLASSES];
+tx_class_t *rx_class = NULL;
+uint8_t tx_sched_class = 0;
+uint8_t tx_sched_count = 0;
+
+uint16_t packet_starts_buf[CONFIG_QUEUE_MAX_LENGTH+TX_CLASSES];
+uint16_t packet_lengths_buf[CONFIG_QUEUE_MAX_LENGTH+TX_CLASSES];
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Times at which queued packets were queued, kept
+  // in parallel with the packet start FIFO slots
+  uint32_t packet_queued_at_buf[CONFIG_QUEUE_MAX_LENGTH+TX_CLASSES];
+#endif
 
 uint8_t packet_queue[CONFIG_QUEUE_SIZE];
 
 volatile uint8_t queue_height = 0;
 volatile uint16_t queued_bytes = 0;
-volatile uint16_t queue_cursor = 0;
-volatile uint16_t current_packet_start = 0;
+
+// Batch frames carry several length-prefixed
+// packets. They are staged in the default class
+// ring past its write cursor, and only committed
+// once the complete frame has been received.
+#define BATCH_MAX_PACKETS 16
+#define BATCH_LEN_H  0x00
+#define BATCH_LEN_L  0x01
+#define BATCH_DATA   0x02
+uint8_t  batch_state = BATCH_LEN_H;
+uint8_t  batch_status = BATCH_OK;
+uint8_t  batch_count = 0;
+uint16_t batch_remaining = 0;
+uint16_t batch_bytes = 0;
+uint16_t batch_cursor = 0;
+uint16_t batch_starts[BATCH_MAX_PACKETS];
+uint16_t batch_lengths[BATCH_MAX_PACKETS];
+tx_class_t *batch_class = NULL;
+
+// Credit based flow control. When enabled, the
+// free queue slots and bytes are pushed to the
+// host as they change, together with a running
+// count of host data frames processed, so the
+// host can reconcile frames still in flight.
+#define CREDITS_INTERVAL_MS 20
+uint16_t credits_frames = 0;
+uint16_t credits_last_slots = 0;
+uint16_t credits_last_bytes = 0;
+uint16_t credits_last_frames = 0;
+uint32_t credits_last_report = 0;
 volatile bool serial_buffering = false;
 #if HAS_BLUETOOTH || HAS_BLE == true
   bool bt_init_ran = false;
@@ -42,14 +115,42 @@ volatile bool serial_buffering = false;
 #endif
 
 #if PLATFORM == PLATFORM_ESP32 || PLATFORM == PLATFORM_NRF52
-  #define MODEM_QUEUE_SIZE 8
+  #define MODEM_QUEUE_SIZE 16
   typedef struct {
           size_t len;
           int rssi;
           int snr_raw;
+          long freq_err;
+          uint32_t timestamp;
           uint8_t data[];
   } modem_packet_t;
   static xQueueHandle modem_packet_queue = NULL;
+
+  // Partially received split packets. Each slot holds
+  // the first part of a split packet until the second
+  // part arrives, or until it times out.
+  typedef struct {
+    uint16_t len;
+    uint8_t  seq;
+    int16_t  rssi;
+    uint32_t started;
+    uint8_t  data[SINGLE_MTU-HEADER_L];
+  } reasm_slot_t;
+  reasm_slot_t reasm_slots[REASM_SLOTS];
+#endif
+
+#if HAS_FRAG
+  // Partially received fragmented packets, with a
+  // bitmask of the segments received so far
+  typedef struct {
+    uint8_t  seq;
+    uint8_t  count;
+    uint16_t received;
+    uint16_t len;
+    uint32_t updated;
+    uint8_t  data[FRAG_MTU];
+  } frag_slot_t;
+  frag_slot_t frag_slots[FRAG_SLOTS];
 #endif
 
 char sbuf[128];
@@ -58,7 +159,46 @@ char sbuf[128];
   bool packet_ready = false;
 #endif
 
+#if (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52) && BOOT_DEFER_PERIPHERALS
+  #define BOOT_STAGE_DISPLAY 0x00
+  #define BOOT_STAGE_BT      0x01
+  #define BOOT_STAGE_WIFI    0x02
+  #define BOOT_STAGE_DONE    0x03
+  uint8_t boot_stage = BOOT_STAGE_DISPLAY;
+
+  // Brings up one deferred peripheral per call, so
+  // that the main loop keeps servicing the radio
+  // in between the stages.
+  void boot_stage_next() {
+    if (boot_stage == BOOT_STAGE_DISPLAY) {
+      #if HAS_DISPLAY
+        display_unblank();
+        disp_ready = display_init();
+        update_display();
+        boot_trace(BOOT_PH_DISPLAY);
+      #endif
+      boot_stage = BOOT_STAGE_BT;
+
+    } else if (boot_stage == BOOT_STAGE_BT) {
+      #if HAS_BLUETOOTH || HAS_BLE == true
+        if (bt_ready && bt_enabled && !console_active) bt_start();
+        boot_trace(BOOT_PH_BT);
+      #endif
+      boot_stage = BOOT_STAGE_WIFI;
+
+    } else if (boot_stage == BOOT_STAGE_WIFI) {
+      #if HAS_WIFI
+        if (!console_active && (wifi_mode == WR_WIFI_STA || wifi_mode == WR_WIFI_AP)) { wifi_remote_init(); }
+        boot_trace(BOOT_PH_WIFI);
+      #endif
+      boot_stage = BOOT_STAGE_DONE;
+      boot_trace_close();
+    }
+  }
+#endif
+
 void setup() {
+  boot_trace(BOOT_PH_START);
   #if MCU_VARIANT == MCU_ESP32
     boot_seq();
     EEPROM.begin(EEPROM_SIZE);
@@ -75,6 +215,7 @@ void setup() {
 
       pinMode(DISPLAY_BL_PIN, OUTPUT);
     #endif
+    boot_trace(BOOT_PH_EEPROM);
   #endif
 
   #if MCU_VARIANT == MCU_NRF52
@@ -91,8 +232,13 @@ void setup() {
     #endif
 
     if (!eeprom_begin()) { Serial.write("EEPROM initialisation failed.\r\n"); }
+    boot_trace(BOOT_PH_EEPROM);
   #endif
 
+  device_config_load();
+  csma_profile_load();
+  boot_trace(BOOT_PH_CONFIG);
+
   // Seed the PRNG for CSMA R-value selection
   #if MCU_VARIANT == MCU_ESP32
     // On ESP32, get the seed value from the
@@ -138,6 +284,7 @@ void setup() {
   #endif
 
   serial_interrupt_init();
+  boot_trace(BOOT_PH_SERIAL);
 
   // Configure input and output pins
   #if HAS_INPUT
@@ -161,12 +308,9 @@ void setup() {
   memset(cmdbuf, 0, sizeof(cmdbuf));
   
   memset(packet_queue, 0, sizeof(packet_queue));
-
   memset(packet_starts_buf, 0, sizeof(packet_starts_buf));
-  fifo16_init(&packet_starts, packet_starts_buf, CONFIG_QUEUE_MAX_LENGTH);
-  
-  memset(packet_lengths_buf, 0, sizeof(packet_starts_buf));
-  fifo16_init(&packet_lengths, packet_lengths_buf, CONFIG_QUEUE_MAX_LENGTH);
+  memset(packet_lengths_buf, 0, sizeof(packet_lengths_buf));
+  tx_classes_init();
 
   #if PLATFORM == PLATFORM_ESP32 || PLATFORM == PLATFORM_NRF52
     modem_packet_queue = xQueueCreate(MODEM_QUEUE_SIZE, sizeof(modem_packet_t*));
@@ -232,36 +376,48 @@ void setup() {
     // so assume that to be the case for now.
     modem_installed = true;
   #endif
+  boot_trace(BOOT_PH_MODEM);
 
   #if HAS_DISPLAY
-    #if HAS_EEPROM
-    if (EEPROM.read(eeprom_addr(ADDR_CONF_DSET)) != CONF_OK_BYTE) {
-    #elif MCU_VARIANT == MCU_NRF52
-    if (eeprom_read(eeprom_addr(ADDR_CONF_DSET)) != CONF_OK_BYTE) {
-    #endif
+    if (device_config.disp_set != CONF_OK_BYTE) {
+      eeprom_transaction_begin();
       eeprom_update(eeprom_addr(ADDR_CONF_DSET), CONF_OK_BYTE);
       #if BOARD_MODEL == BOARD_TECHO
         eeprom_update(eeprom_addr(ADDR_CONF_DINT), 0x03);
       #else
         eeprom_update(eeprom_addr(ADDR_CONF_DINT), 0xFF);
       #endif
+      eeprom_transaction_commit();
     }
     #if BOARD_MODEL == BOARD_TECHO
       display_add_callback(work_while_waiting);
     #endif
 
-    display_unblank();
-    disp_ready = display_init();
-    update_display();
+    #if !BOOT_DEFER_PERIPHERALS
+      display_unblank();
+      disp_ready = display_init();
+      update_display();
+      boot_trace(BOOT_PH_DISPLAY);
+    #endif
   #endif
 
   #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
     #if HAS_PMU == true
       pmu_ready = init_pmu();
+      boot_trace(BOOT_PH_PMU);
     #endif
 
     #if HAS_BLUETOOTH || HAS_BLE == true
-      bt_init();
+      #if BOOT_DEFER_PERIPHERALS
+        // The device hash needs the Bluetooth MAC, so
+        // the controller is set up here, but the stack
+        // is started from the deferred boot stages
+        bt_state = BT_STATE_OFF;
+        bt_setup_hw();
+      #else
+        bt_init();
+        boot_trace(BOOT_PH_BT);
+      #endif
       bt_init_ran = true;
     #endif
 
@@ -273,8 +429,11 @@ void setup() {
       #endif
     } else {
       #if HAS_WIFI
-        wifi_mode = EEPROM.read(eeprom_addr(ADDR_CONF_WIFI));
-        if (wifi_mode == WR_WIFI_STA || wifi_mode == WR_WIFI_AP) { wifi_remote_init(); }
+        wifi_mode = device_config.wifi_mode;
+        #if !BOOT_DEFER_PERIPHERALS
+          if (wifi_mode == WR_WIFI_STA || wifi_mode == WR_WIFI_AP) { wifi_remote_init(); }
+          boot_trace(BOOT_PH_WIFI);
+        #endif
       #endif
       kiss_indicate_reset();
     }
@@ -284,22 +443,25 @@ void setup() {
     #if MODEM == SX1280
       avoid_interference = false;
     #else
-      #if HAS_EEPROM
-        uint8_t ia_conf = EEPROM.read(eeprom_addr(ADDR_CONF_DIA));
-        if (ia_conf == 0x00) { avoid_interference = true; }
-        else                 { avoid_interference = false; }
-      #elif MCU_VARIANT == MCU_NRF52
-        uint8_t ia_conf = eeprom_read(eeprom_addr(ADDR_CONF_DIA));
-        if (ia_conf == 0x00) { avoid_interference = true; }
-        else                 { avoid_interference = false; }
-      #endif
+      uint8_t ia_conf = device_config.dis_ia;
+      if (ia_conf == 0x00) { avoid_interference = true; }
+      else                 { avoid_interference = false; }
     #endif
   #endif
 
   // Validate board health, EEPROM and config
   validate_status();
+  boot_trace(BOOT_PH_STATUS);
+
+  #if (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52) && FW_VALIDATION_DEFERRED
+    device_start_deferred_validation();
+  #endif
 
   if (op_mode != MODE_TNC) LoRa->setFrequency(0);
+
+  #if !BOOT_DEFER_PERIPHERALS
+    boot_trace_close();
+  #endif
 }
 
 void lora_receive() {
@@ -342,20 +504,248 @@ inline void kiss_write_packet() {
   #endif
 }
 
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Extended RX frames carry the packet metadata
+  // inline, as [rssi][snr][freq_err i32][time u32]
+  // followed by the payload. Modems that cannot
+  // measure the frequency error report INT32_MIN.
+  void kiss_write_packet_ext(modem_packet_t *modem_packet) {
+    uint8_t rssi = (uint8_t)(modem_packet->rssi+rssi_offset);
+    int32_t freq_err = modem_packet->freq_err;
+    uint32_t timestamp = modem_packet->timestamp;
+
+    serial_write(FEND);
+    serial_write(CMD_DATA_EXT);
+    escaped_serial_write(rssi);
+    escaped_serial_write((uint8_t)modem_packet->snr_raw);
+    escaped_serial_write(freq_err>>24);
+    escaped_serial_write(freq_err>>16);
+    escaped_serial_write(freq_err>>8);
+    escaped_serial_write(freq_err);
+    escaped_serial_write(timestamp>>24);
+    escaped_serial_write(timestamp>>16);
+    escaped_serial_write(timestamp>>8);
+    escaped_serial_write(timestamp);
+    for (uint16_t i = 0; i < modem_packet->len; i++) { escaped_serial_write(modem_packet->data[i]); }
+    serial_write(FEND);
+  }
+
+  // Drains all received packets currently waiting
+  // in the modem queue into one host transport write
+  void kiss_write_packets_ext() {
+    modem_packet_t *modem_packet = NULL;
+    uint8_t drained = 0;
+    while (drained < MODEM_QUEUE_SIZE && modem_packet_queue && xQueueReceive(modem_packet_queue, &modem_packet, 0) == pdTRUE) {
+      if (!modem_packet) continue;
+      if (drained == 0) kiss_tx_batch_begin();
+
+      last_rssi = modem_packet->rssi;
+      last_snr_raw = modem_packet->snr_raw;
+      kiss_write_packet_ext(modem_packet);
+      free(modem_packet);
+      modem_packet = NULL;
+      drained++;
+    }
+
+    if (drained > 0) {
+      kiss_tx_batch_end();
+      packet_ready = false;
+    }
+  }
+#endif
+
 inline void getPacketData(uint16_t len) {
   #if MCU_VARIANT != MCU_NRF52
-    while (len-- && read_len < MTU) {
+    while (len-- && read_len < MTU_MAX) {
       pbuf[read_len++] = LoRa->read();
     }  
   #else
     BaseType_t int_mask = taskENTER_CRITICAL_FROM_ISR();
-    while (len-- && read_len < MTU) {
+    while (len-- && read_len < MTU_MAX) {
       pbuf[read_len++] = LoRa->read();
     }
     taskEXIT_CRITICAL_FROM_ISR(int_mask);
   #endif
 }
 
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Handles one part of a split packet. Returns true
+  // if it completed a packet, which is then in pbuf.
+  bool reasm_receive(uint8_t sequence, int packet_size, bool arq) {
+    uint32_t now = millis();
+
+    // ARQ senders keep the second part short of a full
+    // frame, so a full frame is always a first part. A
+    // waiting part with the same sequence is then left
+    // over from an attempt whose second part was lost,
+    // and is replaced rather than joined.
+    bool restart = arq && packet_size == SINGLE_MTU-HEADER_L;
+    int16_t rssi = 0;
+    #if REASM_FINGERPRINT
+      // Read in the receive callback like the packet
+      // metadata in modem_packet_enqueue()
+      #if MCU_VARIANT == MCU_NRF52
+        BaseType_t rssi_mask = taskENTER_CRITICAL_FROM_ISR();
+        rssi = LoRa->packetRssi();
+        taskEXIT_CRITICAL_FROM_ISR(rssi_mask);
+      #else
+        rssi = LoRa->packetRssi();
+      #endif
+    #endif
+
+    reasm_slot_t *match = NULL;
+    reasm_slot_t *victim = NULL;
+    uint16_t match_delta = 0;
+    for (uint8_t i = 0; i < REASM_SLOTS; i++) {
+      reasm_slot_t *s = &reasm_slots[i];
+      if (s->len > 0 && now-s->started > reasm_timeout_ms) { s->len = 0; }
+      if (restart && s->len > 0 && s->seq == sequence) { s->len = 0; }
+
+      if (s->len > 0 && s->seq == sequence) {
+        uint16_t delta = (s->rssi > rssi) ? s->rssi-rssi : rssi-s->rssi;
+        #if REASM_FINGERPRINT
+          if (delta > REASM_RSSI_TOLERANCE) { continue; }
+        #endif
+        if (match == NULL || delta < match_delta) { match = s; match_delta = delta; }
+      }
+
+      if (victim == NULL || (victim->len > 0 && (s->len == 0 || (int32_t)(s->started-victim->started) < 0))) { victim = s; }
+    }
+
+    if (match != NULL) {
+      // This is the second part, so the packet is
+      // put back together in pbuf
+      #if MCU_VARIANT == MCU_NRF52
+        BaseType_t int_mask = taskENTER_CRITICAL_FROM_ISR();
+        memcpy(pbuf, match->data, match->len); read_len = match->len;
+        taskEXIT_CRITICAL_FROM_ISR(int_mask);
+      #else
+        memcpy(pbuf, match->data, match->len); read_len = match->len;
+      #endif
+      match->len = 0;
+
+      getPacketData(packet_size);
+      return true;
+
+    } else if (packet_size == SINGLE_MTU-HEADER_L) {
+      // The first part of a split packet always fills
+      // a whole frame. If all slots are in use, the
+      // oldest partial packet is given up.
+      victim->seq = sequence;
+      victim->rssi = rssi;
+      victim->started = now;
+      for (uint16_t i = 0; i < packet_size; i++) { victim->data[i] = LoRa->read(); }
+      victim->len = packet_size;
+    }
+
+    // Otherwise this is a second part whose first part
+    // was never received, and it is dropped
+    return false;
+  }
+#endif
+
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Passes a received packet to the main loop
+  void modem_packet_enqueue(const uint8_t *data, uint16_t len) {
+    // Allocate packet struct, but abort if there
+    // is not enough memory available.
+    modem_packet_t *modem_packet = (modem_packet_t*)malloc(sizeof(modem_packet_t) + len);
+    if(!modem_packet) { memory_low = true; return; }
+
+    // Get packet RSSI and SNR
+    #if MCU_VARIANT == MCU_ESP32
+      modem_packet->snr_raw = LoRa->packetSnrRaw();
+      modem_packet->rssi = LoRa->packetRssi(modem_packet->snr_raw);
+      modem_packet->freq_err = rx_ext ? LoRa->packetFrequencyError() : 0;
+    #elif MCU_VARIANT == MCU_NRF52
+      BaseType_t int_mask = taskENTER_CRITICAL_FROM_ISR();
+      modem_packet->rssi = LoRa->packetRssi();
+      modem_packet->snr_raw = LoRa->packetSnrRaw();
+      modem_packet->freq_err = rx_ext ? LoRa->packetFrequencyError() : 0;
+      taskEXIT_CRITICAL_FROM_ISR(int_mask);
+    #endif
+    modem_packet->timestamp = millis();
+
+    // Send packet to event queue, but free the
+    // allocated memory again if the queue is
+    // unable to receive the packet.
+    modem_packet->len = len;
+    memcpy(modem_packet->data, data, len);
+    if (!modem_packet_queue || xQueueSendFromISR(modem_packet_queue, &modem_packet, NULL) != pdPASS) {
+        free(modem_packet);
+    }
+  }
+
+  // Splits an aggregated frame back into the packets
+  // it carries. A malformed length prefix discards
+  // the rest of the frame.
+  void aggr_receive(int packet_size) {
+    uint8_t data[AGGR_PAYLOAD_L];
+    if (packet_size > AGGR_PAYLOAD_L) { packet_size = AGGR_PAYLOAD_L; }
+    for (int i = 0; i < packet_size; i++) { data[i] = LoRa->read(); }
+
+    uint16_t pos = 0;
+    while (pos < packet_size) {
+      uint8_t length = data[pos++];
+      if (length < MIN_L || pos+length > packet_size) { break; }
+      modem_packet_enqueue(data+pos, length);
+      pos += length;
+    }
+  }
+#endif
+
+#if HAS_FRAG
+  // Handles one segment of a fragmented packet. Returns
+  // true if it completed a packet, which is then in pbuf.
+  bool frag_receive(uint8_t sequence, int packet_size) {
+    if (packet_size < 2) { return false; }
+    uint8_t segment = LoRa->read(); packet_size--;
+    uint8_t index = segment >> 4;
+    uint8_t count = segment & 0x0F;
+    if (count > FRAG_MAX_SEGMENTS || index >= count) { return false; }
+    if (index < count-1 && packet_size != FRAG_SEGMENT_L) { return false; }
+    if (packet_size > FRAG_SEGMENT_L) { return false; }
+
+    uint32_t now = millis();
+    frag_slot_t *slot = NULL;
+    frag_slot_t *victim = NULL;
+    for (uint8_t i = 0; i < FRAG_SLOTS; i++) {
+      frag_slot_t *s = &frag_slots[i];
+      if (s->received != 0 && now-s->updated > reasm_timeout_ms) { s->received = 0; }
+      if (s->received != 0 && s->seq == sequence && s->count == count && !(s->received & (1 << index))) { slot = s; }
+      if (victim == NULL || (victim->received != 0 && (s->received == 0 || (int32_t)(s->updated-victim->updated) < 0))) { victim = s; }
+    }
+
+    if (slot == NULL) {
+      slot = victim;
+      slot->seq = sequence;
+      slot->count = count;
+      slot->received = 0;
+      slot->len = 0;
+    }
+
+    uint16_t offset = index*FRAG_SEGMENT_L;
+    for (uint16_t i = 0; i < packet_size; i++) { slot->data[offset+i] = LoRa->read(); }
+    if (index == count-1) { slot->len = offset+packet_size; }
+    slot->received |= (1 << index);
+    slot->updated = now;
+
+    if (slot->received == (1 << count)-1) {
+      #if MCU_VARIANT == MCU_NRF52
+        BaseType_t int_mask = taskENTER_CRITICAL_FROM_ISR();
+        memcpy(pbuf, slot->data, slot->len); read_len = slot->len;
+        taskEXIT_CRITICAL_FROM_ISR(int_mask);
+      #else
+        memcpy(pbuf, slot->data, slot->len); read_len = slot->len;
+      #endif
+      slot->received = 0;
+      return true;
+    }
+
+    return false;
+  }
+#endif
+
 void ISR_VECT receive_callback(int packet_size) {
   #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
     BaseType_t int_mask;
@@ -371,6 +761,65 @@ void ISR_VECT receive_callback(int packet_size) {
     uint8_t sequence = packetSequence(header);
     bool    ready    = false;
 
+    #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    // Split packets are joined through the reassembly
+    // slots, so that split packets from several nodes
+    // can be received interleaved with each other and
+    // with unsplit packets.
+    if ((header & FLAG_ARQ) && packet_size == 0) {
+      // Header-only frames are ARQ acknowledgements
+      arq_ack_received(&arq_state, sequence);
+
+    } else if (header & FLAG_AGGR) {
+      aggr_receive(packet_size);
+
+    } else if (header & FLAG_FRAG) {
+      // Without fragmentation support, fragmented
+      // packets cannot be received and are dropped
+      #if HAS_FRAG
+        ready = frag_receive(sequence, packet_size);
+      #endif
+
+    } else if (isSplitPacket(header)) {
+      ready = reasm_receive(sequence, packet_size, arq_enabled && (header & FLAG_ARQ));
+
+    } else {
+      #if MCU_VARIANT == MCU_NRF52
+        int_mask = taskENTER_CRITICAL_FROM_ISR(); read_len = 0; taskEXIT_CRITICAL_FROM_ISR(int_mask);
+      #else
+        read_len = 0;
+      #endif
+
+      getPacketData(packet_size);
+      ready = true;
+    }
+
+    // In ARQ mode, complete packets are acknowledged,
+    // and retransmissions of the last packet that was
+    // passed on are acknowledged again but dropped.
+    // The session epoch is taken off the end first.
+    if (ready && arq_enabled && (header & FLAG_ARQ)) {
+      #if MCU_VARIANT == MCU_NRF52
+        int_mask = taskENTER_CRITICAL_FROM_ISR();
+      #endif
+      uint8_t epoch = 0;
+      if (read_len > ARQ_EPOCH_L) { read_len -= ARQ_EPOCH_L; epoch = pbuf[read_len]; }
+      else                        { ready = false; read_len = 0; }
+      #if MCU_VARIANT == MCU_NRF52
+        taskEXIT_CRITICAL_FROM_ISR(int_mask);
+      #endif
+
+      if (ready && !arq_rx_accept(&arq_state, sequence, epoch, millis())) {
+        ready = false;
+        #if MCU_VARIANT == MCU_NRF52
+          int_mask = taskENTER_CRITICAL_FROM_ISR(); read_len = 0; taskEXIT_CRITICAL_FROM_ISR(int_mask);
+        #else
+          read_len = 0;
+        #endif
+      }
+    }
+
+    #else
     if (isSplitPacket(header) && seq == SEQ_UNSET) {
       // This is the first part of a split
       // packet, so we set the seq variable
@@ -446,6 +895,7 @@ void ISR_VECT receive_callback(int packet_size) {
       getPacketData(packet_size);
       ready = true;
     }
+    #endif
 
     if (ready) {
       #if MCU_VARIANT != MCU_ESP32 && MCU_VARIANT != MCU_NRF52
@@ -459,25 +909,7 @@ void ISR_VECT receive_callback(int packet_size) {
         kiss_write_packet(); read_len = 0;
       
       #else
-        // Allocate packet struct, but abort if there
-        // is not enough memory available.
-        modem_packet_t *modem_packet = (modem_packet_t*)malloc(sizeof(modem_packet_t) + read_len);
-        if(!modem_packet) { memory_low = true; return; }
-
-        // Get packet RSSI and SNR
-        #if MCU_VARIANT == MCU_ESP32
-          modem_packet->snr_raw = LoRa->packetSnrRaw();
-          modem_packet->rssi = LoRa->packetRssi(modem_packet->snr_raw);
-        #endif
-
-        // Send packet to event queue, but free the
-        // allocated memory again if the queue is
-        // unable to receive the packet.
-        modem_packet->len = read_len;
-        memcpy(modem_packet->data, pbuf, read_len); read_len = 0;
-        if (!modem_packet_queue || xQueueSendFromISR(modem_packet_queue, &modem_packet, NULL) != pdPASS) {
-            free(modem_packet);
-        }
+        modem_packet_enqueue(pbuf, read_len); read_len = 0;
       #endif
     }  
   } else {
@@ -519,6 +951,7 @@ bool startRadio() {
         return false;
       } else {
         radio_online = true;
+        boot_trace(BOOT_PH_RADIO);
 
         init_channel_stats();
 
@@ -569,39 +1002,256 @@ void update_radio_lock() {
   }
 }
 
-bool queue_full() { return (queue_height >= CONFIG_QUEUE_MAX_LENGTH || queued_bytes >= CONFIG_QUEUE_SIZE); }
+void tx_classes_init() {
+  uint16_t base = 0; uint16_t slot_base = 0;
+  for (uint8_t i = 0; i < TX_CLASSES; i++) {
+    tx_class_t *c = &tx_classes[i];
+    memset(c, 0, sizeof(tx_class_t));
+    if (i < TX_CLASSES-1) {
+      c->size = (uint32_t)CONFIG_QUEUE_SIZE*tx_class_share[i]/8;
+      c->max_height = (uint16_t)CONFIG_QUEUE_MAX_LENGTH*tx_class_share[i]/8;
+      if (c->max_height == 0) c->max_height = 1;
+    } else {
+      c->size = CONFIG_QUEUE_SIZE-base;
+      c->max_height = CONFIG_QUEUE_MAX_LENGTH-slot_base;
+    }
+    c->base = base;
+    fifo16_init(&c->starts, packet_starts_buf+slot_base+i, c->max_height);
+    fifo16_init(&c->lengths, packet_lengths_buf+slot_base+i, c->max_height);
+    #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+      c->queued_at = packet_queued_at_buf+slot_base+i;
+      c->ttl = QUEUE_TTL_MS;
+    #endif
+    base += c->size; slot_base += c->max_height;
+  }
+  queue_height = 0; queued_bytes = 0;
+}
+
+tx_class_t *tx_class_for(uint8_t prio) {
+  if (prio >= TX_CLASSES) prio = TX_CLASSES-1;
+  return &tx_classes[prio];
+}
 
-volatile bool queue_flushing = false;
-void flush_queue(void) {
-  if (!queue_flushing) {
-    queue_flushing = true;
-    led_tx_on();
+bool tx_class_full(tx_class_t *c) { return (c->height >= c->max_height || c->bytes >= c->size); }
+
+bool queue_full() { return tx_class_full(&tx_classes[TX_CLASS_DEFAULT]); }
+
+void tx_class_write(tx_class_t *c, uint8_t byte) {
+  if (c->height < c->max_height && c->bytes < c->size) {
+    packet_queue[c->base+c->cursor++] = byte;
+    if (c->cursor == c->size) c->cursor = 0;
+    c->pending++; c->bytes++; queued_bytes++;
+  } else {
+    c->overflow = true;
+  }
+}
+
+// Adds a packet to the FIFOs of a class, recording
+// when it was queued
+void tx_class_enqueue(tx_class_t *c, uint16_t start, uint16_t length) {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    c->queued_at[c->starts.tail - c->starts.begin] = millis();
+  #endif
+  fifo16_push(&c->starts, start);
+  fifo16_push(&c->lengths, length);
+}
+
+// Drops packets from the head of a class for as
+// long as their time to live has passed
+void tx_class_expire(tx_class_t *c) {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    while (c->ttl != 0 && c->height > 0) {
+      uint32_t queued_at = c->queued_at[c->starts.head - c->starts.begin];
+      if (millis()-queued_at < c->ttl) break;
+
+      fifo16_pop(&c->starts);
+      uint16_t length = fifo16_pop(&c->lengths);
+      c->height -= 1; queue_height -= 1;
+      c->bytes -= length; queued_bytes -= length;
+      c->stat_expired++;
+    }
+  #endif
+}
+
+// Largest packet accepted from the host. In ARQ
+// mode, room is left for the session epoch, and
+// split packets are kept to ARQ_SPLIT_MAX.
+uint16_t host_mtu() {
+  uint16_t mtu = MTU;
+  #if HAS_FRAG
+    if (frag_mode) { mtu = FRAG_MTU; }
+  #endif
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    if (arq_enabled) {
+      if (mtu == MTU) { mtu = ARQ_SPLIT_MAX; }
+      mtu -= ARQ_EPOCH_L;
+    }
+  #endif
+  return mtu;
+}
+
+// Completes the frame being written into a class.
+// Frames that were truncated because the class ran
+// full are rolled back and counted as dropped.
+void tx_class_commit(tx_class_t *c) {
+  if (!c->overflow && c->pending >= MIN_L && c->pending <= host_mtu() && !fifo16_isfull(&c->starts)) {
+    tx_class_enqueue(c, c->current_start, c->pending);
+    c->height++; queue_height++;
+    c->stat_queued++;
+  } else {
+    c->cursor = c->current_start;
+    c->bytes -= c->pending; queued_bytes -= c->pending;
+    if (c->pending > 0 || c->overflow) c->stat_dropped++;
+  }
+  c->current_start = c->cursor;
+  c->pending = 0; c->overflow = false;
+}
+
+// Selects the class to serve next, after dropping
+// expired packets. The scheduler state is only
+// advanced when a packet is actually taken, so
+// the head can be inspected beforehand.
+tx_class_t *tx_class_select(bool advance) {
+  for (uint8_t i = 0; i < TX_CLASSES; i++) { tx_class_expire(&tx_classes[i]); }
+
+  #if TX_QUEUE_WEIGHTED
+    // Weighted round robin, serving up to the weight
+    // of each class in packets before moving on
+    uint8_t sched_class = tx_sched_class;
+    uint8_t sched_count = tx_sched_count;
+    for (uint8_t n = 0; n <= TX_CLASSES; n++) {
+      tx_class_t *c = &tx_classes[sched_class];
+      if (c->height > 0 && sched_count < tx_class_weight[sched_class]) {
+        if (advance) { tx_sched_class = sched_class; tx_sched_count = sched_count+1; }
+        return c;
+      }
+      sched_class = (sched_class+1)%TX_CLASSES; sched_count = 0;
+    }
+  #else
+    for (uint8_t i = 0; i < TX_CLASSES; i++) {
+      if (tx_classes[i].height > 0) return &tx_classes[i];
+    }
+  #endif
+  return NULL;
+}
+
+tx_class_t *tx_class_next() { return tx_class_select(true); }
+tx_class_t *tx_class_head() { return tx_class_select(false); }
+
+// Moves the oldest packet of a class into dst,
+// and returns its length
+uint16_t tx_class_pop(tx_class_t *c, uint8_t *dst) {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    uint16_t start = fifo16_pop(&c->starts);
+    uint16_t length = fifo16_pop(&c->lengths);
+  #else
+    uint16_t start = fifo16_pop_locked(&c->starts);
+    uint16_t length = fifo16_pop_locked(&c->lengths);
+  #endif
 
+  for (uint16_t i = 0; i < length; i++) {
+    uint16_t pos = (start+i)%c->size;
+    dst[i] = packet_queue[c->base+pos];
+  }
+
+  c->height -= 1; queue_height -= 1;
+  c->bytes -= length; queued_bytes -= length;
+  c->stat_sent++;
+  return length;
+}
+
+bool airtime_eligible(tx_class_t *c);
+
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Counts the packets at the head of a class that
+  // fit in one aggregated frame. The frame is full
+  // when the next queued packet would not fit, or
+  // when there is no room left for another packet.
+  uint8_t aggr_count(tx_class_t *c, bool *full) {
+    uint16_t used = 0; uint8_t count = 0;
+    uint16_t *p = c->lengths.head;
+    *full = true;
+    while (p != c->lengths.tail && count < AGGR_MAX_PACKETS) {
+      uint16_t length = *p;
+      if (used+1+length > AGGR_PAYLOAD_L) { return count; }
+      used += 1+length; count++;
+      p = (p == c->lengths.end) ? c->lengths.begin : p+1;
+    }
+
+    if (count < AGGR_MAX_PACKETS && used+1+MIN_L <= AGGR_PAYLOAD_L) { *full = false; }
+    return count;
+  }
+
+  // Holds back channel access while the frame at the
+  // head of the queue could still take more packets,
+  // but never for longer than the aggregation window
+  // counted from when the oldest packet was queued
+  bool aggr_hold() {
+    if (aggr_window_ms == 0 || promisc || arq_enabled) { return false; }
+    tx_class_t *c = tx_class_head();
+    if (c == NULL) { return false; }
+
+    bool full; aggr_count(c, &full);
+    if (full) { return false; }
+    uint32_t queued_at = c->queued_at[c->starts.head - c->starts.begin];
+    return millis()-queued_at < aggr_window_ms;
+  }
+#endif
+
+// Takes the next packet of a class and transmits
+// it. With aggregation enabled, the small packets
+// queued behind it in the same class are packed
+// into the same frame with one byte length prefixes.
+void tx_class_transmit(tx_class_t *c) {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    bool full;
+    uint8_t count = (aggr_window_ms != 0 && !promisc && !arq_enabled) ? aggr_count(c, &full) : 0;
+    if (count > 1) {
+      uint16_t size = 0;
+      for (uint8_t i = 0; i < count; i++) {
+        uint16_t length = tx_class_pop(c, tbuf+size+1);
+        tbuf[size] = length; size += 1+length;
+      }
+      transmit_aggregate(size);
+      return;
+    }
+  #endif
+
+  uint16_t length = tx_class_pop(c, tbuf);
+  if (length >= MIN_L && length <= MTU_MAX) {
     #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
-    while (!fifo16_isempty(&packet_starts)) {
+      bool arq = arq_enabled && !promisc;
+      if (arq) {
+        // Packets queued before ARQ was enabled may
+        // leave no room for the session epoch. They
+        // were counted as sent when popped, and are
+        // moved over to the dropped count.
+        if (length > host_mtu()) { c->stat_sent--; c->stat_dropped++; return; }
+        arq_tx_begin(&arq_state);
+        tbuf[length++] = arq_state.epoch;
+      }
+      transmit(length);
+      if (arq) { arq_len = length; arq_tx_sent(&arq_state, millis()); }
     #else
-    while (!fifo16_isempty_locked(&packet_starts)) {
+      transmit(length);
     #endif
+  }
+}
 
-      uint16_t start = fifo16_pop(&packet_starts);
-      uint16_t length = fifo16_pop(&packet_lengths);
-
-      if (length >= MIN_L && length <= MTU) {
-        for (uint16_t i = 0; i < length; i++) {
-          uint16_t pos = (start+i)%CONFIG_QUEUE_SIZE;
-          tbuf[i] = packet_queue[pos];
-        }
+volatile bool queue_flushing = false;
+void flush_queue(void) {
+  if (!queue_flushing) {
+    queue_flushing = true;
+    led_tx_on();
 
-        transmit(length);
-      }
+    tx_class_t *c;
+    while ((c = tx_class_head()) != NULL && airtime_eligible(c)) {
+      tx_class_transmit(tx_class_next());
     }
 
     lora_receive(); led_tx_off();
   }
 
-  queue_height = 0;
-  queued_bytes = 0;
-
   #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
     update_airtime();
   #endif
@@ -617,24 +1267,9 @@ void pop_queue() {
   if (!queue_flushing) {
     queue_flushing = true; led_tx_on();
 
-    #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
-    if (!fifo16_isempty(&packet_starts)) {
-    #else
-    if (!fifo16_isempty_locked(&packet_starts)) {
-    #endif
-
-      uint16_t start = fifo16_pop(&packet_starts);
-      uint16_t length = fifo16_pop(&packet_lengths);
-      if (length >= MIN_L && length <= MTU) {
-        for (uint16_t i = 0; i < length; i++) {
-          uint16_t pos = (start+i)%CONFIG_QUEUE_SIZE;
-          tbuf[i] = packet_queue[pos];
-        }
-
-        transmit(length);
-      }
-      queue_height -= 1;
-      queued_bytes -= length;
+    tx_class_t *c = tx_class_head();
+    if (c != NULL && airtime_eligible(c)) {
+      tx_class_transmit(tx_class_next());
     }
 
     lora_receive(); led_tx_off();
@@ -651,45 +1286,153 @@ void pop_queue() {
   #endif
 }
 
-void add_airtime(uint16_t written) {
+void kiss_indicate_queue_stats() {
+  serial_write(FEND);
+  serial_write(CMD_STAT_QUEUE);
+  escaped_serial_write(TX_CLASSES);
+  for (uint8_t i = 0; i < TX_CLASSES; i++) {
+    tx_class_t *c = &tx_classes[i];
+    escaped_serial_write(i);
+    escaped_serial_write(c->height);
+    escaped_serial_write(c->max_height);
+    escaped_serial_write(c->bytes>>8);
+    escaped_serial_write(c->bytes);
+    escaped_serial_write(c->size>>8);
+    escaped_serial_write(c->size);
+    escaped_serial_write(c->stat_queued>>24);
+    escaped_serial_write(c->stat_queued>>16);
+    escaped_serial_write(c->stat_queued>>8);
+    escaped_serial_write(c->stat_queued);
+    escaped_serial_write(c->stat_sent>>24);
+    escaped_serial_write(c->stat_sent>>16);
+    escaped_serial_write(c->stat_sent>>8);
+    escaped_serial_write(c->stat_sent);
+    escaped_serial_write(c->stat_dropped>>24);
+    escaped_serial_write(c->stat_dropped>>16);
+    escaped_serial_write(c->stat_dropped>>8);
+    escaped_serial_write(c->stat_dropped);
+    escaped_serial_write(c->stat_expired>>24);
+    escaped_serial_write(c->stat_expired>>16);
+    escaped_serial_write(c->stat_expired>>8);
+    escaped_serial_write(c->stat_expired);
+    escaped_serial_write(c->ttl>>24);
+    escaped_serial_write(c->ttl>>16);
+    escaped_serial_write(c->ttl>>8);
+    escaped_serial_write(c->ttl);
+  }
+  serial_write(FEND);
+}
+
+// Airtime in milliseconds of a single LoRa frame
+// carrying the specified number of bytes
+float airtime_cost_ms(uint16_t written) {
   #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
-    float lora_symbols = 0;
-    float packet_cost_ms = 0.0;
-    int ldr_opt = 0; if (lora_low_datarate) ldr_opt = 1;
-
-    #if MODEM == SX1276 || MODEM == SX1278
-      lora_symbols += (8*written + PHY_CRC_LORA_BITS - 4*lora_sf + 8 + PHY_HEADER_LORA_SYMBOLS);
-      lora_symbols /=                          4*(lora_sf-2*ldr_opt);
-      lora_symbols *= lora_cr;
-      lora_symbols += lora_preamble_symbols + 0.25 + 8;
-      packet_cost_ms += lora_symbols * lora_symbol_time_ms;
-      
-    #elif MODEM == SX1262 || MODEM == SX1280
-      if (lora_sf < 7) {
-        lora_symbols += (8*written + PHY_CRC_LORA_BITS - 4*lora_sf + PHY_HEADER_LORA_SYMBOLS);
-        lora_symbols /=                              4*lora_sf;
-        lora_symbols *= lora_cr;
-        lora_symbols += lora_preamble_symbols + 2.25 + 8;
-        packet_cost_ms += lora_symbols * lora_symbol_time_ms;
+    return lora_frame_airtime_ms(written, lora_sf, lora_cr, lora_preamble_symbols, lora_symbol_time_ms, lora_low_datarate, MODEM == SX1262 || MODEM == SX1280);
+  #else
+    return 0.0;
+  #endif
+}
 
-      } else {
-        lora_symbols += (8*written + PHY_CRC_LORA_BITS - 4*lora_sf + 8 + PHY_HEADER_LORA_SYMBOLS);
-        lora_symbols /=                         4*(lora_sf-2*ldr_opt);
-        lora_symbols *= lora_cr;
-        lora_symbols += lora_preamble_symbols + 0.25 + 8;
-        packet_cost_ms += lora_symbols * lora_symbol_time_ms;
-      }
-    
-    #endif
+// Predicted airtime of a queued packet, accounting
+// for the header byte and for the second frame that
+// transmit() produces when the packet is split
+float airtime_predict_ms(uint16_t length) {
+  #if HAS_FRAG
+    if (!promisc && length > MTU) {
+      uint8_t count = (length+FRAG_SEGMENT_L-1)/FRAG_SEGMENT_L;
+      return (count-1)*airtime_cost_ms(SINGLE_MTU) + airtime_cost_ms(length-(count-1)*FRAG_SEGMENT_L+FRAG_HEADER_L);
+    }
+  #endif
+
+  if (promisc) {
+    if (length > SINGLE_MTU) { length = SINGLE_MTU; }
+    return airtime_cost_ms(length);
+  } else if (length > SINGLE_MTU - HEADER_L) {
+    return airtime_cost_ms(SINGLE_MTU) + airtime_cost_ms(length - (SINGLE_MTU-HEADER_L) + HEADER_L);
+  } else {
+    return airtime_cost_ms(length + HEADER_L);
+  }
+}
+
+void add_airtime(uint16_t written) {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    float packet_cost_ms = airtime_cost_ms(written);
 
     uint16_t cb = current_airtime_bin();
     uint16_t nb = cb+1; if (nb == AIRTIME_BINS) { nb = 0; }
     airtime_bins[cb] += packet_cost_ms;
     airtime_bins[nb] = 0;
 
+    if (st_airtime_limit != 0.0) { st_airtime_tokens -= packet_cost_ms; }
+    if (lt_airtime_limit != 0.0) { lt_airtime_tokens -= packet_cost_ms; }
+
   #endif
 }
 
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  float st_airtime_capacity() { return st_airtime_limit*AIRTIME_ST_WINDOW_MS; }
+  float lt_airtime_capacity() { return lt_airtime_limit*AIRTIME_LONGTERM_MS; }
+
+  void airtime_budget_refill() {
+    uint32_t now = millis();
+    uint32_t elapsed = now - airtime_tokens_last;
+    airtime_tokens_last = now;
+
+    if (st_airtime_limit != 0.0) {
+      st_airtime_tokens += elapsed*st_airtime_limit;
+      if (st_airtime_tokens > st_airtime_capacity()) { st_airtime_tokens = st_airtime_capacity(); }
+    }
+
+    if (lt_airtime_limit != 0.0) {
+      lt_airtime_tokens += elapsed*lt_airtime_limit;
+      if (lt_airtime_tokens > lt_airtime_capacity()) { lt_airtime_tokens = lt_airtime_capacity(); }
+    }
+  }
+
+  // Milliseconds until a packet with the specified
+  // airtime cost fits within both budgets. Packets
+  // costing more than a full bucket are let through
+  // once the bucket is full, leaving it in debt.
+  uint32_t airtime_wait_ms(float cost) {
+    float wait = 0.0;
+    if (st_airtime_limit != 0.0) {
+      float need = cost; if (need > st_airtime_capacity()) { need = st_airtime_capacity(); }
+      if (st_airtime_tokens < need) { float w = (need-st_airtime_tokens)/st_airtime_limit; if (w > wait) wait = w; }
+    }
+
+    if (lt_airtime_limit != 0.0) {
+      float need = cost; if (need > lt_airtime_capacity()) { need = lt_airtime_capacity(); }
+      if (lt_airtime_tokens < need) { float w = (need-lt_airtime_tokens)/lt_airtime_limit; if (w > wait) wait = w; }
+    }
+
+    return (uint32_t)ceil(wait);
+  }
+
+  bool airtime_eligible(tx_class_t *c) {
+    airtime_budget_refill();
+    return airtime_wait_ms(airtime_predict_ms(fifo16_peek(&c->lengths))) == 0;
+  }
+
+  // Updates the airtime lock from the budget that
+  // the packet at the head of the queue requires,
+  // and lets the host know when it changes
+  void airtime_budget_update() {
+    airtime_budget_refill();
+
+    tx_class_t *c = tx_class_head();
+    uint16_t length = (c != NULL) ? fifo16_peek(&c->lengths) : MIN_L;
+    airtime_wait = airtime_wait_ms(airtime_predict_ms(length));
+
+    bool lock = airtime_wait > 0;
+    if (lock != airtime_lock) {
+      airtime_lock = lock;
+      kiss_indicate_airtime_budget();
+    }
+  }
+#else
+  bool airtime_eligible(tx_class_t *c) { return true; }
+#endif
+
 void update_airtime() {
   #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
     uint16_t cb = current_airtime_bin();
@@ -713,11 +1456,97 @@ void update_airtime() {
   #endif
 }
 
+// The header of an outgoing packet carries a random
+// sequence number, or the ARQ sequence in ARQ mode
+uint8_t tx_header() {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    if (arq_enabled) { return arq_state.seq << 4 | FLAG_ARQ; }
+  #endif
+  return random(256) & 0xF0;
+}
+
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Sends an aggregated frame that has already been
+  // assembled in tbuf
+  void transmit_aggregate(uint16_t size) {
+    if (!radio_online) { kiss_indicate_error(ERROR_TXFAILED); led_indicate_error(5); return; }
+    uint8_t header = (random(256) & 0xF0) | FLAG_AGGR;
+
+    LoRa->beginPacket();
+    LoRa->write(header);
+    for (uint16_t i = 0; i < size; i++) { LoRa->write(tbuf[i]); }
+
+    if (!LoRa->endPacket()) {
+      kiss_indicate_error(ERROR_MODEM_TIMEOUT);
+      kiss_indicate_error(ERROR_TXFAILED);
+      led_indicate_error(5);
+      hard_reset();
+    }
+
+    add_airtime(size+HEADER_L);
+  }
+
+  // Sends the acknowledgement for the last packet
+  // received in ARQ mode. It goes out right away,
+  // without waiting for channel access.
+  void arq_send_ack() {
+    arq_state.ack_due = false;
+    if (!radio_online || airtime_lock) { return; }
+
+    LoRa->beginPacket();
+    LoRa->write(arq_state.ack_seq << 4 | FLAG_ARQ);
+    if (!LoRa->endPacket()) {
+      kiss_indicate_error(ERROR_MODEM_TIMEOUT);
+      kiss_indicate_error(ERROR_TXFAILED);
+      led_indicate_error(5);
+      hard_reset();
+    }
+
+    add_airtime(HEADER_L);
+    lora_receive();
+  }
+#endif
+
+#if HAS_FRAG
+  // Packets larger than the MTU are sent as a train of
+  // segments carrying their index and count, back to
+  // back after the single channel access that was won
+  // for the whole packet
+  void transmit_segments(uint16_t size) {
+    uint8_t header = tx_header() | FLAG_FRAG;
+    uint8_t count  = (size+FRAG_SEGMENT_L-1)/FRAG_SEGMENT_L;
+    uint16_t offset = 0;
+
+    for (uint8_t index = 0; index < count; index++) {
+      uint16_t len = size-offset; if (len > FRAG_SEGMENT_L) { len = FRAG_SEGMENT_L; }
+      LoRa->beginPacket();
+      LoRa->write(header);
+      LoRa->write(index << 4 | count);
+      for (uint16_t i = 0; i < len; i++) { LoRa->write(tbuf[offset+i]); }
+
+      if (!LoRa->endPacket()) {
+        kiss_indicate_error(ERROR_MODEM_TIMEOUT);
+        kiss_indicate_error(ERROR_TXFAILED);
+        led_indicate_error(5);
+        hard_reset();
+      }
+
+      add_airtime(len+FRAG_HEADER_L);
+      offset += len;
+    }
+  }
+#endif
+
 void transmit(uint16_t size) {
   if (radio_online) {
+    #if HAS_FRAG
+      uint16_t split_max = arq_enabled ? ARQ_SPLIT_MAX : MTU;
+      if (!promisc && size > split_max) { transmit_segments(size); return; }
+    #endif
+
     if (!promisc) {
       uint16_t  written = 0;
-      uint8_t header  = random(256) & 0xF0;
+      uint8_t header  = tx_header();
       if (size > SINGLE_MTU - HEADER_L) { header = header | FLAG_SPLIT; }
 
       LoRa->beginPacket();
@@ -762,25 +1591,102 @@ void transmit(uint16_t size) {
   } else { kiss_indicate_error(ERROR_TXFAILED); led_indicate_error(5); }
 }
 
-void serial_callback(uint8_t sbyte) {
-  if (IN_FRAME && sbyte == FEND && command == CMD_DATA) {
-    IN_FRAME = false;
+// Credits describe the default class, which is the
+// one that CMD_DATA and batch frames are queued in
+uint16_t credits_free_slots() { tx_class_t *c = &tx_classes[TX_CLASS_DEFAULT]; return (c->height < c->max_height) ? c->max_height-c->height : 0; }
+uint16_t credits_free_bytes() { tx_class_t *c = &tx_classes[TX_CLASS_DEFAULT]; return (c->bytes < c->size) ? c->size-c->bytes : 0; }
 
-    if (!fifo16_isfull(&packet_starts) && queued_bytes < CONFIG_QUEUE_SIZE) {
-        uint16_t s = current_packet_start;
-        int16_t e = queue_cursor-1; if (e == -1) e = CONFIG_QUEUE_SIZE-1;
-        uint16_t l;
+void kiss_indicate_credits() {
+  uint16_t slots = credits_free_slots();
+  uint16_t bytes = credits_free_bytes();
+  serial_write(FEND);
+  serial_write(CMD_CREDITS);
+  escaped_serial_write(slots>>8);
+  escaped_serial_write(slots);
+  escaped_serial_write(bytes>>8);
+  escaped_serial_write(bytes);
+  escaped_serial_write(credits_frames>>8);
+  escaped_serial_write(credits_frames);
+  serial_write(FEND);
 
-        if (s != e) { l = (s < e) ? e - s + 1 : CONFIG_QUEUE_SIZE - s + e + 1; }
-        else        { l = 1; }
+  credits_last_slots = slots;
+  credits_last_bytes = bytes;
+  credits_last_frames = credits_frames;
+  credits_last_report = millis();
+}
 
-        if (l >= MIN_L) {
-            queue_height++;
-            fifo16_push(&packet_starts, s);
-            fifo16_push(&packet_lengths, l);
-            current_packet_start = queue_cursor;
-        }
+void update_credits() {
+  if (millis()-credits_last_report < CREDITS_INTERVAL_MS) return;
+  if (credits_free_slots() != credits_last_slots || credits_free_bytes() != credits_last_bytes || credits_frames != credits_last_frames) {
+    kiss_indicate_credits();
+  }
+}
+
+void batch_reset() {
+  batch_state = BATCH_LEN_H;
+  batch_status = BATCH_OK;
+  batch_count = 0;
+  batch_remaining = 0;
+  batch_bytes = 0;
+  batch_class = &tx_classes[TX_CLASS_DEFAULT];
+  batch_cursor = batch_class->cursor;
+}
+
+void batch_receive(uint8_t sbyte) {
+  if (batch_status != BATCH_OK) return;
+
+  if (batch_state == BATCH_LEN_H) {
+    batch_remaining = (uint16_t)sbyte << 8;
+    batch_state = BATCH_LEN_L;
+
+  } else if (batch_state == BATCH_LEN_L) {
+    batch_remaining |= sbyte;
+    if (batch_remaining < MIN_L || batch_remaining > host_mtu()) { batch_status = BATCH_MALFORMED; return; }
+    if (batch_count >= BATCH_MAX_PACKETS || batch_class->height+batch_count >= batch_class->max_height) { batch_status = BATCH_FULL; return; }
+    batch_starts[batch_count] = batch_cursor;
+    batch_lengths[batch_count] = batch_remaining;
+    batch_count++;
+    batch_state = BATCH_DATA;
+
+  } else {
+    if (batch_class->bytes+batch_bytes >= batch_class->size) { batch_status = BATCH_FULL; return; }
+    packet_queue[batch_class->base+batch_cursor++] = sbyte;
+    if (batch_cursor == batch_class->size) batch_cursor = 0;
+    batch_bytes++;
+    if (--batch_remaining == 0) batch_state = BATCH_LEN_H;
+  }
+}
+
+void batch_commit() {
+  if (batch_status == BATCH_OK && (batch_count == 0 || batch_state != BATCH_LEN_H)) batch_status = BATCH_MALFORMED;
+
+  if (batch_status == BATCH_OK) {
+    tx_class_t *c = batch_class;
+    for (uint8_t i = 0; i < batch_count; i++) {
+      tx_class_enqueue(c, batch_starts[i], batch_lengths[i]);
     }
+    c->height += batch_count; queue_height += batch_count;
+    c->bytes += batch_bytes; queued_bytes += batch_bytes;
+    c->cursor = batch_cursor;
+    c->current_start = c->cursor;
+    c->stat_queued += batch_count;
+    kiss_indicate_batch(batch_status, batch_count);
+  } else {
+    batch_class->stat_dropped += batch_count;
+    kiss_indicate_batch(batch_status, 0);
+  }
+}
+
+void serial_callback(uint8_t sbyte) {
+  if (IN_FRAME && sbyte == FEND && (command == CMD_DATA || command == CMD_DATA_PRIO)) {
+    IN_FRAME = false;
+    if (rx_class != NULL) { tx_class_commit(rx_class); rx_class = NULL; }
+    credits_frames++;
+
+  } else if (IN_FRAME && sbyte == FEND && command == CMD_DATA_BATCH) {
+    IN_FRAME = false;
+    batch_commit();
+    credits_frames++;
 
   } else if (sbyte == FEND) {
     IN_FRAME = true;
@@ -790,6 +1696,8 @@ void serial_callback(uint8_t sbyte) {
     // Have a look at the command byte first
     if (frame_len == 0 && command == CMD_UNKNOWN) {
         command = sbyte;
+        if (command == CMD_DATA) rx_class = &tx_classes[TX_CLASS_DEFAULT];
+        if (command == CMD_DATA_BATCH) batch_reset();
     } else if (command == CMD_DATA) {
         if (bt_state != BT_STATE_CONNECTED) {
           cable_state = CABLE_STATE_CONNECTED;
@@ -802,11 +1710,101 @@ void serial_callback(uint8_t sbyte) {
                 if (sbyte == TFESC) sbyte = FESC;
                 ESCAPE = false;
             }
-            if (queue_height < CONFIG_QUEUE_MAX_LENGTH && queued_bytes < CONFIG_QUEUE_SIZE) {
-              queued_bytes++;
-              packet_queue[queue_cursor++] = sbyte;
-              if (queue_cursor == CONFIG_QUEUE_SIZE) queue_cursor = 0;
+            tx_class_write(rx_class, sbyte);
+        }
+    } else if (command == CMD_DATA_PRIO) {
+        if (bt_state != BT_STATE_CONNECTED) {
+          cable_state = CABLE_STATE_CONNECTED;
+        }
+        if (sbyte == FESC) {
+            ESCAPE = true;
+        } else {
+            if (ESCAPE) {
+                if (sbyte == TFEND) sbyte = FEND;
+                if (sbyte == TFESC) sbyte = FESC;
+                ESCAPE = false;
+            }
+            // The first byte selects the priority class
+            if (rx_class == NULL) { rx_class = tx_class_for(sbyte); }
+            else                  { tx_class_write(rx_class, sbyte); }
+        }
+    } else if (command == CMD_STAT_QUEUE) {
+      kiss_indicate_queue_stats();
+    } else if (command == CMD_CSMA_PROF) {
+      if (sbyte == FESC) {
+        ESCAPE = true;
+      } else {
+        if (ESCAPE) {
+          if (sbyte == TFEND) sbyte = FEND;
+          if (sbyte == TFESC) sbyte = FESC;
+          ESCAPE = false;
+        }
+        if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+      }
+
+      // The first byte selects whether the profile is
+      // read, set, set and saved, or reset to defaults
+      uint8_t op = cmdbuf[0];
+      if ((frame_len == 1 && (op == CSMA_PROF_READ || op == CSMA_PROF_RESET)) ||
+          (frame_len == 1+sizeof(csma_profile_t) && (op == CSMA_PROF_SET || op == CSMA_PROF_SAVE))) {
+        #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+          if (op != CSMA_PROF_READ) {
+            csma_profile_t p = csma_profile_default;
+            if (op != CSMA_PROF_RESET) memcpy(&p, cmdbuf+1, sizeof(csma_profile_t));
+            if (csma_profile_valid(&p)) {
+              csma_profile = p;
+              if (op != CSMA_PROF_SET) csma_profile_save(op == CSMA_PROF_SAVE);
+              updateBitrate();
+              cw_band = 0; update_csma_parameters();
             }
+          }
+        #endif
+        kiss_indicate_csma_profile();
+      }
+    } else if (command == CMD_QUEUE_TTL) {
+      if (sbyte == FESC) {
+        ESCAPE = true;
+      } else {
+        if (ESCAPE) {
+          if (sbyte == TFEND) sbyte = FEND;
+          if (sbyte == TFESC) sbyte = FESC;
+          ESCAPE = false;
+        }
+        if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+      }
+
+      if (frame_len == 5) {
+        #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+          uint32_t ttl = (uint32_t)cmdbuf[1] << 24 | (uint32_t)cmdbuf[2] << 16 | (uint32_t)cmdbuf[3] << 8 | (uint32_t)cmdbuf[4];
+          for (uint8_t i = 0; i < TX_CLASSES; i++) {
+            if (cmdbuf[0] == TX_PRIO_ALL || tx_class_for(cmdbuf[0]) == &tx_classes[i]) { tx_classes[i].ttl = ttl; }
+          }
+        #endif
+        kiss_indicate_queue_stats();
+      }
+    } else if (command == CMD_STAT_ATBGT) {
+      #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+        kiss_indicate_airtime_budget();
+      #endif
+    } else if (command == CMD_DATA_EXT) {
+      #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+        if (sbyte == 0x01) { rx_ext = true; }
+        if (sbyte == 0x00) { rx_ext = false; }
+      #endif
+      kiss_indicate_rx_ext();
+    } else if (command == CMD_DATA_BATCH) {
+        if (bt_state != BT_STATE_CONNECTED) {
+          cable_state = CABLE_STATE_CONNECTED;
+        }
+        if (sbyte == FESC) {
+            ESCAPE = true;
+        } else {
+            if (ESCAPE) {
+                if (sbyte == TFEND) sbyte = FEND;
+                if (sbyte == TFESC) sbyte = FESC;
+                ESCAPE = false;
+            }
+            batch_receive(sbyte);
         }
     } else if (command == CMD_FREQUENCY) {
       if (sbyte == FESC) {
@@ -950,6 +1948,9 @@ void serial_callback(uint8_t sbyte) {
             st_airtime_limit = (float)at/(100.0*100.0);
             if (st_airtime_limit >= 1.0) { st_airtime_limit = 0.0; }
           }
+          #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+            airtime_budget_refill(); st_airtime_tokens = st_airtime_capacity();
+          #endif
           kiss_indicate_st_alock();
         }
     } else if (command == CMD_LT_ALOCK) {
@@ -973,6 +1974,9 @@ void serial_callback(uint8_t sbyte) {
             lt_airtime_limit = (float)at/(100.0*100.0);
             if (lt_airtime_limit >= 1.0) { lt_airtime_limit = 0.0; }
           }
+          #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+            airtime_budget_refill(); lt_airtime_tokens = lt_airtime_capacity();
+          #endif
           kiss_indicate_lt_alock();
         }
     } else if (command == CMD_STAT_RX) {
@@ -992,6 +1996,9 @@ void serial_callback(uint8_t sbyte) {
       if (sbyte == DETECT_REQ) {
         if (bt_state != BT_STATE_CONNECTED) cable_state = CABLE_STATE_CONNECTED;
         kiss_indicate_detect();
+        #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+          if (!boot_trace_sent) kiss_indicate_boot_trace();
+        #endif
       }
     } else if (command == CMD_PROMISC) {
       if (sbyte == 0x01) {
@@ -1000,6 +2007,60 @@ void serial_callback(uint8_t sbyte) {
         promisc_disable();
       }
       kiss_indicate_promisc();
+    } else if (command == CMD_FRAG_MODE) {
+      #if HAS_FRAG
+        if (sbyte == 0x01) { frag_mode = true; }
+        else if (sbyte == 0x00) { frag_mode = false; }
+      #endif
+      kiss_indicate_frag_mode();
+    } else if (command == CMD_CAD) {
+      #if HAS_CAD
+        if (sbyte == 0x01) { cad_enabled = true; }
+        else if (sbyte == 0x00) { cad_enabled = false; LoRa->cadAbort(); }
+      #endif
+      kiss_indicate_cad();
+    } else if (command == CMD_ARQ) {
+      if (sbyte == FESC) {
+        ESCAPE = true;
+      } else {
+        if (ESCAPE) {
+          if (sbyte == TFEND) sbyte = FEND;
+          if (sbyte == TFESC) sbyte = FESC;
+          ESCAPE = false;
+        }
+        if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+      }
+
+      if (frame_len == 2) {
+        #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+          if (cmdbuf[0] == 0x01 && !arq_enabled) { arq_session_begin(&arq_state, random(16), random(256)); arq_enabled = true; }
+          else if (cmdbuf[0] == 0x00) { arq_enabled = false; arq_state.waiting = false; }
+          if (cmdbuf[0] <= 0x01 && cmdbuf[1] <= 15) { arq_retries = cmdbuf[1]; }
+        #endif
+        kiss_indicate_arq();
+      }
+    } else if (command == CMD_AGGREGATE) {
+      if (sbyte == FESC) {
+        ESCAPE = true;
+      } else {
+        if (ESCAPE) {
+          if (sbyte == TFEND) sbyte = FEND;
+          if (sbyte == TFESC) sbyte = FESC;
+          ESCAPE = false;
+        }
+        if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+      }
+
+      if (frame_len == 2) {
+        #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+          aggr_window_ms = (uint16_t)cmdbuf[0] << 8 | cmdbuf[1];
+        #endif
+        kiss_indicate_aggregate();
+      }
+    } else if (command == CMD_CREDITS) {
+      if (sbyte == 0x01) { credits_enabled = true; }
+      if (sbyte == 0x00) { credits_enabled = false; }
+      kiss_indicate_credits();
     } else if (command == CMD_READY) {
       if (!queue_full()) {
         kiss_indicate_ready();
@@ -1120,8 +2181,17 @@ void serial_callback(uint8_t sbyte) {
           kiss_indicate_bootloader_hash();
         } else if (sbyte == 0x04) {
           kiss_indicate_partition_table_hash();
+        } else if (sbyte == 0x05) {
+          kiss_indicate_hash_stats();
+        } else if (sbyte == 0x06) {
+          if (device_rehash_firmware()) kiss_indicate_fw_hash();
+          kiss_indicate_hash_stats();
         }
       #endif
+    } else if (command == CMD_LOG) {
+      #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+        if (sbyte == LOG_BOOT_TRACE) kiss_indicate_boot_trace();
+      #endif
     } else if (command == CMD_FW_HASH) {
       #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
         if (sbyte == FESC) {
@@ -1165,10 +2235,12 @@ void serial_callback(uint8_t sbyte) {
         }
 
         if (sbyte == 0x00) {
+          eeprom_transaction_begin();
           for (uint8_t i = 0; i<33; i++) {
             if (i<frame_len && i<32) { eeprom_update(config_addr(ADDR_CONF_SSID+i), cmdbuf[i]); }
             else                     { eeprom_update(config_addr(ADDR_CONF_SSID+i), 0x00); }
           }
+          eeprom_transaction_commit();
         }
       #endif
     } else if (command == CMD_WIFI_PSK) {
@@ -1184,10 +2256,12 @@ void serial_callback(uint8_t sbyte) {
         }
 
         if (sbyte == 0x00) {
+          eeprom_transaction_begin();
           for (uint8_t i = 0; i<33; i++) {
             if (i<frame_len && i<32) { eeprom_update(config_addr(ADDR_CONF_PSK+i), cmdbuf[i]); }
             else                     { eeprom_update(config_addr(ADDR_CONF_PSK+i), 0x00); }
           }
+          eeprom_transaction_commit();
         }
       #endif
     } else if (command == CMD_WIFI_IP) {
@@ -1202,7 +2276,11 @@ void serial_callback(uint8_t sbyte) {
           if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
         }
 
-        if (frame_len == 4) { for (uint8_t i = 0; i<4; i++) { eeprom_update(config_addr(ADDR_CONF_IP+i), cmdbuf[i]); } }
+        if (frame_len == 4) {
+          eeprom_transaction_begin();
+          for (uint8_t i = 0; i<4; i++) { eeprom_update(config_addr(ADDR_CONF_IP+i), cmdbuf[i]); }
+          eeprom_transaction_commit();
+        }
       #endif
     } else if (command == CMD_WIFI_NM) {
       #if HAS_WIFI
@@ -1216,7 +2294,43 @@ void serial_callback(uint8_t sbyte) {
           if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
         }
 
-        if (frame_len == 4) { for (uint8_t i = 0; i<4; i++) { eeprom_update(config_addr(ADDR_CONF_NM+i), cmdbuf[i]); } }
+        if (frame_len == 4) {
+          eeprom_transaction_begin();
+          for (uint8_t i = 0; i<4; i++) { eeprom_update(config_addr(ADDR_CONF_NM+i), cmdbuf[i]); }
+          eeprom_transaction_commit();
+        }
+      #endif
+    } else if (command == CMD_WIFI_TRSP) {
+      #if HAS_WIFI
+        if (sbyte == WR_TRANSPORT_TCP || sbyte == WR_TRANSPORT_UDP) {
+          eeprom_update(eeprom_addr(ADDR_CONF_WTRP), sbyte);
+          if (sbyte != wr_transport) {
+            wifi_remote_close_all();
+            wr_transport = sbyte;
+            wifi_remote_start();
+          }
+        }
+        kiss_indicate_wifi_transport();
+      #endif
+    } else if (command == CMD_WIFI_PEER) {
+      #if HAS_WIFI
+        if (sbyte == FESC) { ESCAPE = true; }
+        else {
+          if (ESCAPE) {
+            if (sbyte == TFEND) sbyte = FEND;
+            if (sbyte == TFESC) sbyte = FESC;
+            ESCAPE = false;
+          }
+          if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+        }
+
+        if (frame_len == 6) {
+          eeprom_transaction_begin();
+          for (uint8_t i = 0; i<6; i++) { eeprom_update(config_addr(ADDR_CONF_WPR+i), cmdbuf[i]); }
+          eeprom_transaction_commit();
+          wifi_remote_load_peer();
+          kiss_indicate_wifi_transport();
+        }
       #endif
     } else if (command == CMD_BT_CTRL) {
       #if HAS_BLUETOOTH || HAS_BLE
@@ -1236,6 +2350,40 @@ void serial_callback(uint8_t sbyte) {
           }
         }
       #endif
+    } else if (command == CMD_BT_LINK) {
+      #if HAS_BLE
+        if (sbyte == FESC) {
+            ESCAPE = true;
+        } else {
+            if (ESCAPE) {
+                if (sbyte == TFEND) sbyte = FEND;
+                if (sbyte == TFESC) sbyte = FESC;
+                ESCAPE = false;
+            }
+            if (frame_len < CMD_L) cmdbuf[frame_len++] = sbyte;
+        }
+
+        if (frame_len == 1 && cmdbuf[0] == 0xFF) {
+          kiss_indicate_bt_link();
+        } else if (frame_len == 9) {
+          uint16_t imin = cmdbuf[0] << 8 | cmdbuf[1];
+          uint16_t imax = cmdbuf[2] << 8 | cmdbuf[3];
+          uint16_t latency = cmdbuf[4] << 8 | cmdbuf[5];
+          uint16_t timeout = cmdbuf[6] << 8 | cmdbuf[7];
+          if (bt_link_params_valid(imin, imax, latency, timeout)) {
+            ble_conn_interval_min = imin;
+            ble_conn_interval_max = imax;
+            ble_conn_latency = latency;
+            ble_conn_timeout = timeout;
+            ble_link_opts = cmdbuf[8] & BLE_LINK_OPTS;
+            #if MCU_VARIANT == MCU_NRF52
+              Bluefruit.Periph.setConnInterval(imin, imax);
+            #endif
+            if (bt_state == BT_STATE_CONNECTED) { bt_request_link_params(); }
+          }
+          kiss_indicate_bt_link();
+        }
+      #endif
     } else if (command == CMD_BT_UNPAIR) {
       #if HAS_BLE
         if (sbyte == 0x01) { bt_debond_all(); }
@@ -1346,9 +2494,33 @@ void serial_callback(uint8_t sbyte) {
   portMUX_TYPE update_lock = portMUX_INITIALIZER_UNLOCKED;
 #endif
 
+#if HAS_CAD
+  // Runs a CAD scan once per slot while channel access
+  // is being waited for, and returns whether the last
+  // completed scan found the channel clear. The result
+  // of the previous scan stands while one is running.
+  bool cad_clear() {
+    uint32_t now = millis();
+    if (LoRa->cadActive()) {
+      uint32_t timeout = (uint32_t)ceil(lora_symbol_time_ms*CAD_TIMEOUT_SYMBOLS) + CAD_TIMEOUT_MARGIN_MS;
+      if (now-cad_started > timeout) { LoRa->cadAbort(); cad_counted = true; }
+    } else {
+      if (!cad_counted) { cad_counted = true; if (LoRa->cadDetected()) { cad_detections++; } }
+      if (!dcd && now-cad_started >= csma_slot_ms && LoRa->startCad()) {
+        cad_started = now; cad_scans++; cad_counted = false;
+      }
+    }
+
+    return !LoRa->cadDetected();
+  }
+#endif
+
 bool medium_free() {
   update_modem_status();
   if (avoid_interference && interference_detected) { return false; }
+  #if HAS_CAD
+    if (cad_enabled && !cad_clear()) { return false; }
+  #endif
   return !dcd;
 }
 
@@ -1392,6 +2564,12 @@ uint8_t led_id_filter = 0;
 uint32_t interference_start = 0;
 bool interference_persists = false;
 void update_modem_status() {
+  #if HAS_CAD
+    // The modem is out of receive mode during a CAD
+    // scan, so the last status is kept until it ends
+    if (LoRa->cadActive()) { last_status_update = millis(); return; }
+  #endif
+
   #if MCU_VARIANT == MCU_ESP32
     portENTER_CRITICAL(&update_lock);
   #elif MCU_VARIANT == MCU_NRF52
@@ -1443,28 +2621,40 @@ void update_modem_status() {
 }
 
 void check_modem_status() {
-  if (millis()-last_status_update >= status_interval_ms) {
+  // With CAD enabled, carrier sense for channel access
+  // does not depend on polling, so the modem status is
+  // polled less often while there is nothing to send
+  uint32_t interval = status_interval_ms;
+  #if HAS_CAD
+    if (cad_enabled && queue_height == 0) { interval = CAD_IDLE_STATUS_INTERVAL_MS; }
+  #endif
+
+  if (millis()-last_status_update >= interval) {
     update_modem_status();
     update_noise_floor();
 
     #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
-      util_samples[dcd_sample] = dcd;
-      dcd_sample = (dcd_sample+1)%DCD_SAMPLES;
-      if (dcd_sample % UTIL_UPDATE_INTERVAL == 0) {
-        int util_count = 0;
-        for (int ui = 0; ui < DCD_SAMPLES; ui++) {
-          if (util_samples[ui]) util_count++;
-        }
-        local_channel_util = (float)util_count / (float)DCD_SAMPLES;
-        total_channel_util = local_channel_util + airtime;
-        if (total_channel_util > 1.0) total_channel_util = 1.0;
+      // Each poll stands for the utilisation samples
+      // of the whole interval, to keep the time base
+      for (uint32_t si = 0; si < interval/STATUS_INTERVAL_MS; si++) {
+        util_samples[dcd_sample] = dcd;
+        dcd_sample = (dcd_sample+1)%DCD_SAMPLES;
+        if (dcd_sample % UTIL_UPDATE_INTERVAL == 0) {
+          int util_count = 0;
+          for (int ui = 0; ui < DCD_SAMPLES; ui++) {
+            if (util_samples[ui]) util_count++;
+          }
+          local_channel_util = (float)util_count / (float)DCD_SAMPLES;
+          total_channel_util = local_channel_util + airtime;
+          if (total_channel_util > 1.0) total_channel_util = 1.0;
 
-        int16_t cb = current_airtime_bin();
-        uint16_t nb = cb+1; if (nb == AIRTIME_BINS) { nb = 0; }
-        if (total_channel_util > longterm_bins[cb]) longterm_bins[cb] = total_channel_util;
-        longterm_bins[nb] = 0.0;
+          int16_t cb = current_airtime_bin();
+          uint16_t nb = cb+1; if (nb == AIRTIME_BINS) { nb = 0; }
+          if (total_channel_util > longterm_bins[cb]) longterm_bins[cb] = total_channel_util;
+          longterm_bins[nb] = 0.0;
 
-        update_airtime();
+          update_airtime();
+        }
       }
     #endif
   }
@@ -1537,6 +2727,7 @@ void validate_status() {
               } else {
                 hw_ready = false;
               }
+              boot_trace(BOOT_PH_DEVICE_INIT);
             #else
               hw_ready = true;
             #endif
@@ -1602,51 +2793,53 @@ void validate_status() {
 #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
   void update_csma_parameters() {
     int airtime_pct = (int)(airtime*100);
-    int new_cw_band = cw_band;
+    uint8_t new_cw_band = csma_cw_band(&csma_profile, airtime_pct);
 
-    if (airtime_pct <= CSMA_BAND_1_MAX_AIRTIME) { new_cw_band = 1; }
-    else {
-      int at = airtime_pct + CSMA_BAND_1_MAX_AIRTIME;
-      new_cw_band = map(at, CSMA_BAND_1_MAX_AIRTIME, CSMA_BAND_N_MIN_AIRTIME, 2, CSMA_CW_BANDS);
-    }
-
-    if (new_cw_band > CSMA_CW_BANDS) { new_cw_band = CSMA_CW_BANDS; }
     if (new_cw_band != cw_band) { 
-      cw_band = (uint8_t)(new_cw_band);
-      cw_min  = (cw_band-1) * CSMA_CW_PER_BAND_WINDOWS;
-      cw_max  = (cw_band) * CSMA_CW_PER_BAND_WINDOWS - 1;
+      cw_band = new_cw_band;
+      cw_min  = csma_cw_min(&csma_profile, cw_band);
+      cw_max  = csma_cw_max(&csma_profile, cw_band);
       kiss_indicate_csma_stats();
     }
   }
 #endif
 
-void tx_queue_handler() {
-  if (!airtime_lock && queue_height > 0) {
-    if (csma_cw == -1) {
-      csma_cw = random(cw_min, cw_max);
-      cw_wait_target = csma_cw * csma_slot_ms;
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+  // Sends pending ACKs and runs the ARQ sender. New
+  // packets are held back while the last one is
+  // waiting to be acknowledged or retransmitted.
+  bool arq_handler() {
+    if (arq_state.ack_due) { arq_send_ack(); }
+    if (!arq_enabled) { return false; }
+
+    uint8_t step = arq_tx_step(&arq_state, millis(), arq_timeout, arq_retries);
+    if (step == ARQ_IDLE) { return false; }
+    if (step == ARQ_RETRANSMIT && !airtime_lock) {
+      if (csma_step(&csma_state, millis(), medium_free(), csma_slot_ms, difs_ms, cw_min, cw_max, random)) {
+        led_tx_on();
+        transmit(arq_len);
+        arq_tx_sent(&arq_state, millis());
+        lora_receive(); led_tx_off();
+        update_airtime();
+      }
     }
+    return true;
+  }
+#endif
 
-    if (difs_wait_start == -1) {                                                  // DIFS wait not yet started
-      if (medium_free()) { difs_wait_start = millis(); return; }                  // Set DIFS wait start time
-      else               { return; } }                                            // Medium not yet free, continue waiting
-    
-    else {                                                                        // We are waiting for DIFS or CW to pass
-      if (!medium_free()) { difs_wait_start = -1; cw_wait_start = -1; return; }   // Medium became occupied while in DIFS wait, restart waiting when free again
-      else {                                                                      // Medium is free, so continue waiting
-        if (millis() < difs_wait_start+difs_ms) { return; }                       // DIFS has not yet passed, continue waiting
-        else {                                                                    // DIFS has passed, and we are now in CW wait
-          if (cw_wait_start == -1) { cw_wait_start = millis(); return; }          // If we haven't started counting CW wait time, do it from now
-          else {                                                                  // If we are already counting CW wait time, add it to the counter
-            cw_wait_passed += millis()-cw_wait_start; cw_wait_start   = millis();
-            if (cw_wait_passed < cw_wait_target) { return; }                      // Contention window wait time has not yet passed, continue waiting
-            else {                                                                // Wait time has passed, flush the queue
-              bool should_flush = !lora_limit_rate && !lora_guard_rate;
-              if (should_flush) { flush_queue(); } else { pop_queue(); }
-              cw_wait_passed = 0; csma_cw = -1; difs_wait_start = -1; }
-          }
-        }
-      }
+void tx_queue_handler() {
+  #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+    if (arq_handler()) { return; }
+    if (aggr_hold()) { return; }
+  #endif
+
+  if (!airtime_lock && queue_height > 0) {
+    if (csma_step(&csma_state, millis(), medium_free(), csma_slot_ms, difs_ms, cw_min, cw_max, random)) {
+      bool should_flush = !lora_limit_rate && !lora_guard_rate;
+      #if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+        if (arq_enabled) { should_flush = false; }
+      #endif
+      if (should_flush) { flush_queue(); } else { pop_queue(); }
     }
   }
 }
@@ -1657,7 +2850,9 @@ void loop() {
   if (radio_online) {
     #if MCU_VARIANT == MCU_ESP32
       modem_packet_t *modem_packet = NULL;
-      if(modem_packet_queue && xQueueReceive(modem_packet_queue, &modem_packet, 0) == pdTRUE && modem_packet) {
+      if (rx_ext) {
+        kiss_write_packets_ext();
+      } else if(modem_packet_queue && xQueueReceive(modem_packet_queue, &modem_packet, 0) == pdTRUE && modem_packet) {
         host_write_len = modem_packet->len;
         last_rssi      = modem_packet->rssi;
         last_snr_raw   = modem_packet->snr_raw;
@@ -1670,30 +2865,26 @@ void loop() {
         kiss_write_packet();
       }
 
-      airtime_lock = false;
-      if (st_airtime_limit != 0.0 && airtime >= st_airtime_limit) airtime_lock = true;
-      if (lt_airtime_limit != 0.0 && longterm_airtime >= lt_airtime_limit) airtime_lock = true;
+      airtime_budget_update();
 
     #elif MCU_VARIANT == MCU_NRF52
       modem_packet_t *modem_packet = NULL;
-      if(modem_packet_queue && xQueueReceive(modem_packet_queue, &modem_packet, 0) == pdTRUE && modem_packet) {
+      if (rx_ext) {
+        kiss_write_packets_ext();
+      } else if(modem_packet_queue && xQueueReceive(modem_packet_queue, &modem_packet, 0) == pdTRUE && modem_packet) {
         memcpy(&pbuf, modem_packet->data, modem_packet->len);
         host_write_len = modem_packet->len;
+        last_rssi      = modem_packet->rssi;
+        last_snr_raw   = modem_packet->snr_raw;
         free(modem_packet);
         modem_packet = NULL;
 
-        portENTER_CRITICAL();
-        last_rssi = LoRa->packetRssi();
-        last_snr_raw = LoRa->packetSnrRaw();
-        portEXIT_CRITICAL();
         kiss_indicate_stat_rssi();
         kiss_indicate_stat_snr();
         kiss_write_packet();
       }
 
-      airtime_lock = false;
-      if (st_airtime_limit != 0.0 && airtime >= st_airtime_limit) airtime_lock = true;
-      if (lt_airtime_limit != 0.0 && longterm_airtime >= lt_airtime_limit) airtime_lock = true;
+      airtime_budget_update();
 
     #endif
 
@@ -1743,6 +2934,24 @@ void loop() {
     input_read();
   #endif
 
+  #if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
+    update_eeprom();
+  #endif
+
+  #if (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52) && BOOT_DEFER_PERIPHERALS
+    if (boot_stage != BOOT_STAGE_DONE) boot_stage_next();
+  #endif
+
+  if (credits_enabled) update_credits();
+
+  #if (MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52) && FW_VALIDATION_DEFERRED
+    if (hw_ready && !device_firmware_ok()) {
+      // Deferred validation failed, take the radio down
+      hw_ready = false;
+      if (radio_online) { stopRadio(); kiss_indicate_radiostate(); }
+    }
+  #endif
+
   if (memory_low) {
     #if PLATFORM == PLATFORM_ESP32
       if (esp_get_free_heap_size() < 8192) {
@@ -1889,7 +3098,7 @@ void buffer_serial() {
       #elif HAS_BLUETOOTH || HAS_BLE == true || HAS_WIFI
         if      (bt_state == BT_STATE_CONNECTED) { if (!fifo_isfull(&serialFIFO)) { fifo_push(&serialFIFO, SerialBT.read()); } }
         #if HAS_WIFI
-        else if (wifi_host_is_connected())       { if (!fifo_isfull(&serialFIFO)) { fifo_push(&serialFIFO, wifi_remote_read()); } }
+        else if (wifi_host_is_connected())       { while (wifi_remote_buffered() > 0 && !fifo_isfull(&serialFIFO)) { fifo_push(&serialFIFO, wifi_remote_read()); } }
         #endif
         else                                     { if (!fifo_isfull(&serialFIFO)) { fifo_push(&serialFIFO, Serial.read()); } }
       #else
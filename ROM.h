@@ -46,6 +46,7 @@
   #define ADDR_CONF_DIA  0xB9
   #define ADDR_CONF_WIFI 0xBA
   #define ADDR_CONF_WCHN 0xBB
+  #define ADDR_CONF_WTRP 0xBC
 
   #define INFO_LOCK_BYTE 0x73
   #define CONF_OK_BYTE   0x73
@@ -58,6 +59,8 @@
   #define ADDR_CONF_PSK  0x21
   #define ADDR_CONF_IP   0x42
   #define ADDR_CONF_NM   0x46
+  #define ADDR_CONF_WPR  0x4A
+  #define ADDR_CONF_BLOCK 0x80
   //////////////////////////////////
 
 #endif
@@ -14,6 +14,7 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <WiFi.h>
+#include <WiFiUdp.h>
 
 #if CONFIG_IDF_TARGET_ESP32
   #include "esp32/rom/rtc.h"
@@ -31,6 +32,43 @@
 #define WR_SOCKET_TIMEOUT 6
 #define WR_READ_TIMEOUT_MS 6500
 #define WR_RECONNECT_INTERVAL_MS 10000
+#define WR_TX_FLUSH_TIMEOUT_MS 5
+
+// In UDP mode, every KISS frame travels as one datagram,
+// consisting of the command byte followed by the frame
+// payload without KISS escaping. Incoming datagrams are
+// re-framed into the KISS byte stream on arrival, so the
+// command set is identical to the TCP and serial links.
+// The largest datagram is an extended RX frame, with ten
+// bytes of metadata ahead of a packet of MTU_MAX bytes.
+#define WR_PORT 7633
+#define WR_UDP_MAX_DATAGRAM (1+10+MTU_MAX)
+
+// Socket data is moved in bulk through these buffers, so
+// lwIP is only entered once per read or written frame,
+// rather than once per byte. The buffers default to a
+// single TCP segment, and can be overridden per board.
+// In UDP mode, the TX buffer must hold one unescaped
+// datagram, and the RX buffer one re-escaped datagram,
+// so builds with fragmentation support get larger ones.
+#ifndef WR_TX_BUFFER_SIZE
+  #if WR_UDP_MAX_DATAGRAM > 1460
+    #define WR_TX_BUFFER_SIZE WR_UDP_MAX_DATAGRAM
+  #else
+    #define WR_TX_BUFFER_SIZE 1460
+  #endif
+#endif
+#ifndef WR_RX_BUFFER_SIZE
+  #if 2*WR_UDP_MAX_DATAGRAM+2 > 1460
+    #define WR_RX_BUFFER_SIZE (2*WR_UDP_MAX_DATAGRAM+2)
+  #else
+    #define WR_RX_BUFFER_SIZE 1460
+  #endif
+#endif
+
+#if WR_TX_BUFFER_SIZE < WR_UDP_MAX_DATAGRAM || WR_RX_BUFFER_SIZE < 2*WR_UDP_MAX_DATAGRAM+2
+  #error "WR_TX_BUFFER_SIZE and WR_RX_BUFFER_SIZE are too small for the UDP transport at this MTU"
+#endif
 
 uint32_t wifi_update_interval_ms = WIFI_UPDATE_INTERVAL_MS;
 uint32_t last_wifi_update = 0;
@@ -38,7 +76,13 @@ uint32_t wr_last_connect_try = 0;
 uint32_t wr_last_read = 0;
 
 WiFiClient connection;
-WiFiServer remote_listener(7633, 1);
+WiFiServer remote_listener(WR_PORT, 1);
+WiFiUDP remote_udp;
+IPAddress wr_peer_ip;
+uint16_t wr_peer_port = 0;
+bool wr_peer_static = false;
+bool wr_peer_known = false;
+bool wr_tx_escape = false;
 IPAddress ap_ip(10, 0, 0, 1);
 IPAddress ap_nm(255, 255, 255, 0);
 IPAddress wr_device_ip;
@@ -52,6 +96,16 @@ bool wifi_initialized = false;
 char wr_ssid[33];
 char wr_psk[33];
 
+uint8_t wr_rx_buf[WR_RX_BUFFER_SIZE];
+uint16_t wr_rx_pos = 0;
+uint16_t wr_rx_len = 0;
+uint8_t wr_tx_buf[WR_TX_BUFFER_SIZE];
+uint8_t wr_udp_datagram[WR_UDP_MAX_DATAGRAM];
+uint16_t wr_tx_len = 0;
+uint32_t wr_tx_last = 0;
+bool wr_tx_in_frame = false;
+bool wr_tx_hold = false;
+
 extern void host_disconnected();
 
 void wifi_dbg(String msg) { Serial.print("[WiFi] "); Serial.println(msg); }
@@ -59,7 +113,26 @@ void wifi_dbg(String msg) { Serial.print("[WiFi] "); Serial.println(msg); }
 uint8_t wifi_remote_mode() { return wifi_mode; }
 
 bool wifi_is_connected() { return (wr_wifi_status == WL_CONNECTED); }
-bool wifi_host_is_connected() { if (connection) { return true; } else { return false; } }
+bool wifi_host_is_connected() {
+  if (wr_transport == WR_TRANSPORT_UDP) { return wr_state == WR_STATE_CONNECTED; }
+  if (connection) { return true; } else { return false; }
+}
+
+void wifi_remote_load_peer() {
+  uint8_t *peer = device_config.wifi_peer;
+  bool ip_set = !(peer[0]==0x00 && peer[1]==0x00 && peer[2]==0x00 && peer[3]==0x00) &&
+                !(peer[0]==0xFF && peer[1]==0xFF && peer[2]==0xFF && peer[3]==0xFF);
+  uint16_t port = (uint16_t)peer[4] << 8 | peer[5];
+  if (port == 0xFFFF) { port = 0; }
+
+  // A zero address means the peer is learned from the
+  // source of the most recent datagram. Otherwise, only
+  // datagrams from the configured address are accepted.
+  wr_peer_static = ip_set;
+  wr_peer_known = false;
+  if (ip_set) { wr_peer_ip = IPAddress(peer[0], peer[1], peer[2], peer[3]); }
+  wr_peer_port = port;
+}
 
 void wifi_remote_start_ap() {
   WiFi.mode(WIFI_AP);
@@ -78,13 +151,11 @@ void wifi_remote_start_ap() {
 void wifi_remote_start_sta() {
   WiFi.mode(WIFI_STA);
 
-  uint8_t ip[4]; bool ip_ok = true;
-  for (uint8_t i = 0; i < 4; i++) { ip[i]  = EEPROM.read(config_addr(ADDR_CONF_IP+i)); }
+  uint8_t *ip = device_config.wifi_ip; bool ip_ok = true;
   if (ip[0]==0x00 && ip[1]==0x00 && ip[2]==0x00 && ip[3]==0x00) { ip_ok = false; }
   if (ip[0]==0xFF && ip[1]==0xFF && ip[2]==0xFF && ip[3]==0xFF) { ip_ok = false; }
 
-  uint8_t nm[4]; bool nm_ok = true;
-  for (uint8_t i = 0; i < 4; i++) { nm[i]  = EEPROM.read(config_addr(ADDR_CONF_NM+i)); }
+  uint8_t *nm = device_config.wifi_nm; bool nm_ok = true;
   if (nm[0]==0x00 && nm[1]==0x00 && nm[2]==0x00 && nm[3]==0x00) { nm_ok = false; }
   if (nm[0]==0xFF && nm[1]==0xFF && nm[2]==0xFF && nm[3]==0xFF) { nm_ok = false; }
 
@@ -118,11 +189,16 @@ void wifi_remote_start() {
   else if (wifi_mode == WR_WIFI_STA) { wifi_remote_start_sta(); }
   else                               { wifi_remote_stop(); }
 
+  remote_listener.end(); remote_udp.stop();
   if (wifi_initialized == true) {
-    remote_listener.begin();
-    remote_listener.setTimeout(WR_SOCKET_TIMEOUT);
+    if (wr_transport == WR_TRANSPORT_UDP) {
+      remote_udp.begin(WR_PORT);
+    } else {
+      remote_listener.begin();
+      remote_listener.setTimeout(WR_SOCKET_TIMEOUT);
+    }
     wr_state = WR_STATE_ON;
-  } else { remote_listener.end(); wr_state = WR_STATE_OFF; }
+  } else { wr_state = WR_STATE_OFF; }
 }
 
 void wifi_remote_init() {
@@ -135,15 +211,28 @@ void wifi_remote_init() {
   WiFi.setHostname(wr_hostname);
 
   wr_ssid[32] = 0x00; wr_psk[32] = 0x00;
-  for (uint8_t i = 0; i < 32; i++) { wr_ssid[i] = EEPROM.read(config_addr(ADDR_CONF_SSID+i)); if (wr_ssid[i] == 0xFF) { wr_ssid[i] = 0x00; } }
-  for (uint8_t i = 0; i < 32; i++) { wr_psk[i]  = EEPROM.read(config_addr(ADDR_CONF_PSK+i));  if (wr_psk[i]  == 0xFF) { wr_psk[i]  = 0x00; } }
-  wr_channel = EEPROM.read(eeprom_addr(ADDR_CONF_WCHN)); if (wr_channel < 1 || wr_channel > 14) { wr_channel = WR_CHANNEL_DEFAULT; }
+  for (uint8_t i = 0; i < 32; i++) { wr_ssid[i] = device_config.wifi_ssid[i]; if (wr_ssid[i] == 0xFF) { wr_ssid[i] = 0x00; } }
+  for (uint8_t i = 0; i < 32; i++) { wr_psk[i]  = device_config.wifi_psk[i];  if (wr_psk[i]  == 0xFF) { wr_psk[i]  = 0x00; } }
+  wr_channel = device_config.wifi_chn; if (wr_channel < 1 || wr_channel > 14) { wr_channel = WR_CHANNEL_DEFAULT; }
+  wr_transport = device_config.wifi_transport; if (wr_transport != WR_TRANSPORT_UDP) { wr_transport = WR_TRANSPORT_TCP; }
+  wifi_remote_load_peer();
   wifi_remote_start();
   wifi_init_ran = true;
 }
 
+void wifi_remote_reset_buffers() {
+  wr_rx_pos = 0; wr_rx_len = 0;
+  wr_tx_len = 0; wr_tx_in_frame = false; wr_tx_escape = false;
+}
+
 void wifi_remote_close_all() {
   // wifi_dbg("Close all"); // TODO: Remove debug
+  wifi_remote_reset_buffers();
+  if (wr_transport == WR_TRANSPORT_UDP) {
+    if (!wr_peer_static) { wr_peer_known = false; }
+    wr_state = WR_STATE_ON;
+    return;
+  }
   if (connection) { connection.stop(); }
   WiFiClient client = remote_listener.available();
   while (client) { client.stop(); client = remote_listener.available(); }
@@ -151,6 +240,13 @@ void wifi_remote_close_all() {
 }
 
 void wifi_remote_check_active() {
+  if (wr_transport == WR_TRANSPORT_UDP) {
+    if (wr_state == WR_STATE_CONNECTED && millis()-wr_last_read >= WR_READ_TIMEOUT_MS) {
+      wifi_remote_close_all();
+      host_disconnected();
+    }
+    return;
+  }
   if (millis()-wr_last_read >= WR_READ_TIMEOUT_MS) {
     // wifi_dbg("Connection activity timed out"); // TODO: Remove debug
     if (connection && connection.connected()) {
@@ -161,11 +257,54 @@ void wifi_remote_check_active() {
   }
 }
 
+bool wifi_remote_fill() {
+  int read = connection.read(wr_rx_buf, WR_RX_BUFFER_SIZE);
+  if (read > 0) { wr_rx_pos = 0; wr_rx_len = read; wr_last_read = millis(); return true; }
+  else          { return false; }
+}
+
+bool wifi_remote_receive_datagram() {
+  uint8_t *datagram = wr_udp_datagram;
+  while (true) {
+    int size = remote_udp.parsePacket();
+    if (size <= 0) { return false; }
+
+    IPAddress source = remote_udp.remoteIP();
+    if ((wr_peer_static && source != wr_peer_ip) || size > WR_UDP_MAX_DATAGRAM) { remote_udp.flush(); continue; }
+    int read = remote_udp.read(datagram, size);
+    if (read <= 0) { continue; }
+
+    if (!wr_peer_static) { wr_peer_ip = source; }
+    if (!wr_peer_static || wr_peer_port == 0) { wr_peer_port = remote_udp.remotePort(); }
+    wr_peer_known = true;
+    wr_state = WR_STATE_CONNECTED;
+    wr_last_read = millis();
+
+    wr_rx_pos = 0; wr_rx_len = 0;
+    wr_rx_buf[wr_rx_len++] = FEND;
+    for (int i = 0; i < read; i++) {
+      uint8_t byte = datagram[i];
+      if      (byte == FEND) { wr_rx_buf[wr_rx_len++] = FESC; byte = TFEND; }
+      else if (byte == FESC) { wr_rx_buf[wr_rx_len++] = FESC; byte = TFESC; }
+      wr_rx_buf[wr_rx_len++] = byte;
+    }
+    wr_rx_buf[wr_rx_len++] = FEND;
+    return true;
+  }
+}
+
+uint16_t wifi_remote_buffered() { return wr_rx_len-wr_rx_pos; }
+
 bool wifi_remote_available() {
+  if (wr_rx_pos < wr_rx_len) { return true; }
+  if (wr_transport == WR_TRANSPORT_UDP) {
+    if (wifi_remote_receive_datagram()) { return true; }
+    else                                { wifi_remote_check_active(); return false; }
+  }
   if (connection) {
     if (connection.connected()) {
-      if (connection.available()) { wr_last_read = millis(); return true; }
-      else                        { wifi_remote_check_active(); return false; }
+      if (connection.available() && wifi_remote_fill()) { return true; }
+      else                                              { wifi_remote_check_active(); return false; }
     } else {
       // wifi_dbg("Client disconnected"); // TODO: Remove debug
       wifi_remote_close_all();
@@ -177,16 +316,20 @@ bool wifi_remote_available() {
     else {
       // wifi_dbg("Client connected"); // TODO: Remove debug
       connection = client;
+      connection.setNoDelay(true);
+      wifi_remote_reset_buffers();
       wr_state = WR_STATE_CONNECTED;
       wr_last_read = millis();
-      if (connection.available()) { return true; }
+      if (connection.available()) { return wifi_remote_fill(); }
       else                        { return false; }
     }
   }
 }
 
 uint8_t wifi_remote_read() {
-  if (connection && connection.available()) { return connection.read(); }
+  if (wr_rx_pos < wr_rx_len) { return wr_rx_buf[wr_rx_pos++]; }
+  else if (wr_transport == WR_TRANSPORT_UDP) { return FEND; }
+  else if (connection && connection.available() && wifi_remote_fill()) { return wr_rx_buf[wr_rx_pos++]; }
   else {
     // wifi_dbg("Error: No data to read from TCP socket"); // TODO: Remove debug
     if (connection) { wifi_remote_close_all(); }
@@ -194,7 +337,56 @@ uint8_t wifi_remote_read() {
   }
 }
 
-void wifi_remote_write(uint8_t byte) { if (connection) { connection.write(byte); } }
+void wifi_remote_flush() {
+  if (wr_tx_len > 0) {
+    if (connection) { connection.write(wr_tx_buf, wr_tx_len); }
+    wr_tx_len = 0;
+  }
+}
+
+void wifi_remote_send_datagram() {
+  if (wr_tx_len > 0 && wr_peer_known && wr_peer_port != 0) {
+    remote_udp.beginPacket(wr_peer_ip, wr_peer_port);
+    remote_udp.write(wr_tx_buf, wr_tx_len);
+    remote_udp.endPacket();
+  }
+  wr_tx_len = 0;
+}
+
+void wifi_remote_write_udp(uint8_t byte) {
+  // Outgoing KISS frames are unescaped into the send buffer,
+  // which is then sent as one datagram per frame
+  if (byte == FEND) {
+    wifi_remote_send_datagram();
+    wr_tx_escape = false;
+    wr_tx_in_frame = true;
+  } else if (wr_tx_in_frame) {
+    if (byte == FESC) { wr_tx_escape = true; return; }
+    if (wr_tx_escape) {
+      if (byte == TFEND) byte = FEND;
+      if (byte == TFESC) byte = FESC;
+      wr_tx_escape = false;
+    }
+    if (wr_tx_len < WR_TX_BUFFER_SIZE) { wr_tx_buf[wr_tx_len++] = byte; }
+    else                               { wr_tx_len = 0; wr_tx_in_frame = false; }
+  }
+}
+
+void wifi_remote_write(uint8_t byte) {
+  if (wr_transport == WR_TRANSPORT_UDP) { wifi_remote_write_udp(byte); return; }
+  if (connection) {
+    if (wr_tx_len >= WR_TX_BUFFER_SIZE) { wifi_remote_flush(); }
+    wr_tx_buf[wr_tx_len++] = byte;
+    wr_tx_last = millis();
+
+    // Whole frames are handed to the socket at once, as soon
+    // as the closing FEND has been buffered
+    if (byte == FEND) {
+      if (wr_tx_in_frame) { if (!wr_tx_hold) wifi_remote_flush(); wr_tx_in_frame = false; }
+      else                { wr_tx_in_frame = true; }
+    }
+  }
+}
 
 void wifi_update_status() {
   wr_wifi_status = WiFi.status();
@@ -206,6 +398,7 @@ void wifi_update_status() {
 }
 
 void update_wifi() {
+  if (wr_transport == WR_TRANSPORT_TCP && wr_tx_len > 0 && millis()-wr_tx_last >= WR_TX_FLUSH_TIMEOUT_MS) { wifi_remote_flush(); }
   if (millis()-last_wifi_update >= wifi_update_interval_ms) {
     wifi_update_status();
     last_wifi_update = millis();
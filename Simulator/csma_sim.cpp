@@ -0,0 +1,702 @@
+// Copyright (C) 2024, Mark Qvist
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Multi-node channel access simulator. Every node
+// runs the contention logic from CSMA.h against a
+// shared virtual channel, driven by a virtual
+// millisecond clock. The queue handling mirrors
+// tx_queue_handler(), flush_queue(), pop_queue(),
+// add_airtime() and update_airtime() in the firmware.
+//
+// With -L, a single point-to-point link with a given
+// frame loss rate is simulated instead, with and
+// without the ARQ state machine from ARQ.h.
+//
+// Run "./csma_sim -h" for the available options.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "CSMA.h"
+#include "ARQ.h"
+
+// Mirrored from Config.h
+#define MTU                        508
+#define SINGLE_MTU                 255
+#define HEADER_L                   1
+#define LORA_PREAMBLE_SYMBOLS_MIN  18
+#define LORA_PREAMBLE_TARGET_MS    24
+#define LORA_PREAMBLE_FAST_DELTA   18
+#define LORA_FAST_THRESHOLD_BPS    30E3
+#define LORA_LIMIT_THRESHOLD_BPS   60E3
+#define LORA_GUARD_THRESHOLD_BPS   14E3
+#define AIRTIME_LONGTERM_MS        3600000
+#define AIRTIME_BINLEN_MS          7500
+#define AIRTIME_BINS               (AIRTIME_LONGTERM_MS/AIRTIME_BINLEN_MS)
+#define UTIL_UPDATE_INTERVAL_MS    1000
+#define REASM_TIMEOUT_MARGIN_MS    250
+#define ARQ_SPLIT_MAX              (MTU-1)
+
+// Time from the end of a received packet until the
+// ACK starts, covering the receiver's main loop
+#define ARQ_ACK_TURNAROUND_MS      5
+
+typedef struct {
+  int      sf;
+  long     bw;
+  int      cr;
+  float    txp;
+  float    path_loss_exp;
+  float    area_m;
+  float    capture_db;
+  int      dcd_symbols;
+  uint16_t payload;
+  uint16_t queue_max;
+  bool     sx126x;
+  uint8_t  arq_retries;
+} sim_params_t;
+
+typedef struct {
+  float    symbol_time_ms;
+  float    preamble_symbols;
+  bool     fast_rate;
+  bool     limit_rate;
+  bool     guard_rate;
+  bool     low_datarate;
+  int      slot_ms;
+  uint32_t difs_ms;
+  float    sens;
+} sim_radio_t;
+
+typedef struct {
+  uint16_t len;
+  int      dst;
+  uint32_t enqueued;
+} sim_packet_t;
+
+// Reasons a packet was not delivered. A packet is
+// counted under the first reason that hit one of
+// its frames.
+#define LOSS_NONE        0
+#define LOSS_RANGE       1  // Destination out of range
+#define LOSS_HALF_DUPLEX 2  // Source or destination was transmitting
+#define LOSS_COLLISION   3  // Overlapped by a frame that was not captured over
+#define LOSS_CAUSES      4
+
+typedef struct {
+  int      src;
+  int      dst;
+  uint32_t start;
+  uint32_t end;
+  bool     last;
+  uint8_t  lost;
+  bool     collided;
+  uint32_t enqueued;
+  uint16_t len;
+} sim_frame_t;
+
+typedef struct {
+  float    x, y;
+  std::deque<sim_packet_t> queue;
+  csma_state_t csma;
+  uint8_t  cw_band, cw_min, cw_max;
+  uint16_t airtime_bins[AIRTIME_BINS];
+  float    airtime;
+  uint32_t busy_until;
+  uint32_t next_arrival;
+  uint8_t  packet_loss;
+  uint64_t stat_offered, stat_dropped, stat_sent, stat_delivered, stat_delivered_bytes;
+} sim_node_t;
+
+typedef struct {
+  uint64_t offered, dropped, sent, delivered, frames, collided;
+  uint64_t lost[LOSS_CAUSES], truncated;
+  double   goodput_bps, throughput, jain, speedup;
+  uint32_t p50, p90, p99;
+  uint32_t retransmits, failed, duplicates, corrupt;
+} sim_result_t;
+
+static std::mt19937 rng;
+
+// Same semantics as random(min, max) on Arduino
+static long sim_random(long min, long max) {
+  if (min >= max) return min;
+  return min + (long)(rng() % (unsigned long)(max-min));
+}
+
+static float sensitivity_dbm(const sim_params_t *p) {
+  static const float snr_limit[] = { -5.0, -7.5, -10.0, -12.5, -15.0, -17.5, -20.0 };
+  int i = p->sf-6; if (i < 0) i = 0; if (i > 6) i = 6;
+  return -174.0 + 10.0*log10((double)p->bw) + 6.0 + snr_limit[i];
+}
+
+static float rssi_dbm(const sim_params_t *p, const sim_node_t *a, const sim_node_t *b) {
+  float d = hypotf(a->x-b->x, a->y-b->y); if (d < 1.0) d = 1.0;
+  return p->txp - (31.2 + 10.0*p->path_loss_exp*log10(d));
+}
+
+static uint16_t current_bin(uint32_t now) { return (now%AIRTIME_LONGTERM_MS)/AIRTIME_BINLEN_MS; }
+
+// Radio timing, as computed by updateBitrate()
+static sim_radio_t radio_setup(const sim_params_t *p) {
+  sim_radio_t r;
+  r.symbol_time_ms = 1000.0*pow(2, p->sf)/(float)p->bw;
+  uint32_t bitrate = (uint32_t)(p->sf * ((4.0/(float)p->cr) / ((float)(pow(2, p->sf))/((float)p->bw/1000.0))) * 1000.0);
+  r.fast_rate  = bitrate > LORA_FAST_THRESHOLD_BPS;
+  r.limit_rate = bitrate > LORA_LIMIT_THRESHOLD_BPS;
+  r.guard_rate = !r.limit_rate && bitrate > LORA_GUARD_THRESHOLD_BPS;
+  r.low_datarate = (long)((1<<p->sf)/(p->bw/1000)) > 16;
+  float preamble_target_ms = LORA_PREAMBLE_TARGET_MS; if (r.fast_rate) preamble_target_ms -= LORA_PREAMBLE_FAST_DELTA;
+  r.preamble_symbols = preamble_target_ms/r.symbol_time_ms;
+  if (r.preamble_symbols < LORA_PREAMBLE_SYMBOLS_MIN) r.preamble_symbols = LORA_PREAMBLE_SYMBOLS_MIN; else r.preamble_symbols = ceil(r.preamble_symbols);
+
+  r.slot_ms = csma_slot_time_ms(&csma_profile_default, r.symbol_time_ms, r.fast_rate);
+  r.difs_ms = csma_difs_time_ms(&csma_profile_default, r.slot_ms);
+  r.sens = sensitivity_dbm(p);
+  return r;
+}
+
+static float frame_airtime(const sim_params_t *p, const sim_radio_t *r, uint16_t written) {
+  return lora_frame_airtime_ms(written, p->sf, p->cr, (long)r->preamble_symbols, r->symbol_time_ms, r->low_datarate, p->sx126x);
+}
+
+static float packet_airtime(const sim_params_t *p, const sim_radio_t *r) {
+  return (p->payload > SINGLE_MTU-HEADER_L)
+    ? frame_airtime(p, r, SINGLE_MTU) + frame_airtime(p, r, p->payload-(SINGLE_MTU-HEADER_L)+HEADER_L)
+    : frame_airtime(p, r, p->payload+HEADER_L);
+}
+
+static void node_init(sim_node_t *node) {
+  node->csma = CSMA_STATE_INIT;
+  node->cw_band = 1; node->cw_min = 0; node->cw_max = CSMA_CW_PER_BAND_WINDOWS;
+  memset(node->airtime_bins, 0, sizeof(node->airtime_bins));
+  node->airtime = 0.0; node->busy_until = 0;
+  node->packet_loss = LOSS_NONE;
+  node->stat_offered = node->stat_dropped = node->stat_sent = node->stat_delivered = node->stat_delivered_bytes = 0;
+}
+
+static void node_add_airtime(sim_node_t *node, uint32_t now, float airtime_ms) {
+  uint16_t cb = current_bin(now);
+  uint16_t nb = cb+1; if (nb == AIRTIME_BINS) nb = 0;
+  node->airtime_bins[cb] += airtime_ms;
+  node->airtime_bins[nb] = 0;
+}
+
+static void node_update_airtime(sim_node_t *node, uint32_t now) {
+  const csma_profile_t *profile = &csma_profile_default;
+  uint16_t cb = current_bin(now);
+  uint16_t pb = (cb == 0) ? AIRTIME_BINS-1 : cb-1;
+  uint16_t nb = cb+1; if (nb == AIRTIME_BINS) nb = 0;
+  node->airtime_bins[nb] = 0;
+  node->airtime = (float)(node->airtime_bins[cb]+node->airtime_bins[pb])/(2.0*AIRTIME_BINLEN_MS);
+  uint8_t band = csma_cw_band(profile, (int)(node->airtime*100));
+  if (band != node->cw_band) {
+    node->cw_band = band;
+    node->cw_min = csma_cw_min(profile, band);
+    node->cw_max = csma_cw_max(profile, band);
+  }
+}
+
+static void latency_percentiles(std::vector<uint32_t> *latencies, sim_result_t *r) {
+  if (latencies->empty()) return;
+  std::sort(latencies->begin(), latencies->end());
+  r->p50 = (*latencies)[latencies->size()*50/100];
+  r->p90 = (*latencies)[latencies->size()*90/100];
+  r->p99 = (*latencies)[latencies->size()*99/100];
+}
+
+static sim_result_t simulate(const sim_params_t *p, int n_nodes, float load, uint32_t duration_ms, uint32_t seed) {
+  rng.seed(seed);
+  std::uniform_real_distribution<float> pos(0.0, p->area_m);
+
+  sim_radio_t radio = radio_setup(p);
+  int slot_ms = radio.slot_ms;
+  uint32_t difs_ms = radio.difs_ms;
+  bool limit_rate = radio.limit_rate, guard_rate = radio.guard_rate;
+  uint32_t dcd_delay_ms = (uint32_t)ceil(p->dcd_symbols*radio.symbol_time_ms);
+  float sens = radio.sens;
+  float packet_airtime_ms = packet_airtime(p, &radio);
+
+  // Offered load is the total airtime the nodes
+  // would use without any losses or contention
+  double rate_per_ms = load/(n_nodes*packet_airtime_ms);
+  std::exponential_distribution<double> interarrival(rate_per_ms);
+
+  std::vector<sim_node_t> nodes(n_nodes);
+  std::vector<std::vector<float>> rssi(n_nodes, std::vector<float>(n_nodes));
+  for (int i = 0; i < n_nodes; i++) {
+    sim_node_t *node = &nodes[i];
+    node->x = pos(rng); node->y = pos(rng);
+    node_init(node);
+    node->next_arrival = (uint32_t)interarrival(rng);
+  }
+  for (int i = 0; i < n_nodes; i++) for (int j = 0; j < n_nodes; j++) rssi[i][j] = (i == j) ? 0.0 : rssi_dbm(p, &nodes[i], &nodes[j]);
+
+  // Packets go to a random neighbour in range, or to
+  // any other node if none is
+  std::vector<std::vector<int>> neighbours(n_nodes);
+  for (int i = 0; i < n_nodes; i++) for (int j = 0; j < n_nodes; j++) if (i != j && rssi[i][j] >= sens) neighbours[i].push_back(j);
+
+  std::vector<sim_frame_t> pending, active;
+  std::vector<uint32_t> latencies;
+  uint64_t frames = 0, collided = 0;
+  uint64_t lost[LOSS_CAUSES] = { 0 };
+
+  // Queues the frames of one packet back to back,
+  // splitting it the same way transmit() does
+  auto transmit = [&](int src, uint32_t at, const sim_packet_t *pkt) {
+    uint16_t remaining = pkt->len;
+    while (remaining > 0) {
+      uint16_t chunk = remaining > SINGLE_MTU-HEADER_L ? SINGLE_MTU-HEADER_L : remaining;
+      uint16_t written = chunk+HEADER_L;
+      remaining -= chunk;
+      float airtime_ms = frame_airtime(p, &radio, written);
+      sim_frame_t f = { src, pkt->dst, at, at+(uint32_t)ceil(airtime_ms), remaining == 0, LOSS_NONE, false, pkt->enqueued, pkt->len };
+      node_add_airtime(&nodes[src], at, airtime_ms);
+      pending.push_back(f);
+      at = f.end;
+    }
+    return at;
+  };
+
+  auto frame_start = [&](sim_frame_t *f) {
+    if (rssi[f->src][f->dst] < sens) f->lost = LOSS_RANGE;
+    for (sim_frame_t &a : active) {
+      if (a.src == f->src) continue;
+      if (a.dst == f->src && !a.lost) a.lost = LOSS_HALF_DUPLEX;
+      if (f->dst == a.src && !f->lost) f->lost = LOSS_HALF_DUPLEX;
+      if (a.dst != f->src && rssi[f->src][a.dst] > rssi[a.src][a.dst]-p->capture_db) a.collided = true;
+      if (f->dst != a.src && rssi[a.src][f->dst] > rssi[f->src][f->dst]-p->capture_db) f->collided = true;
+    }
+    active.push_back(*f);
+  };
+
+  auto frame_end = [&](const sim_frame_t *f) {
+    sim_node_t *src = &nodes[f->src];
+    frames++;
+    if (f->collided) collided++;
+    uint8_t loss = f->lost ? f->lost : (f->collided ? LOSS_COLLISION : LOSS_NONE);
+    if (src->packet_loss == LOSS_NONE) src->packet_loss = loss;
+    if (f->last) {
+      if (src->packet_loss == LOSS_NONE) {
+        src->stat_delivered++;
+        src->stat_delivered_bytes += f->len;
+        latencies.push_back(f->end-f->enqueued);
+      } else {
+        lost[src->packet_loss]++;
+      }
+      src->packet_loss = LOSS_NONE;
+    }
+  };
+
+  clock_t wall_start = clock();
+  uint32_t next_util = UTIL_UPDATE_INTERVAL_MS;
+  uint32_t now = 0;
+  while (now < duration_ms) {
+    for (int i = 0; i < n_nodes; i++) {
+      sim_node_t *node = &nodes[i];
+      while (node->next_arrival <= now) {
+        node->stat_offered++;
+        if (node->queue.size() >= p->queue_max) { node->stat_dropped++; }
+        else {
+          int dst;
+          if (!neighbours[i].empty()) dst = neighbours[i][sim_random(0, neighbours[i].size())];
+          else { dst = sim_random(0, n_nodes-1); if (dst >= i) dst++; }
+          node->queue.push_back({ p->payload, dst, node->next_arrival });
+        }
+        node->next_arrival += 1+(uint32_t)interarrival(rng);
+      }
+    }
+
+    for (size_t k = 0; k < active.size();) {
+      if (active[k].end <= now) { frame_end(&active[k]); active.erase(active.begin()+k); }
+      else k++;
+    }
+
+    for (size_t k = 0; k < pending.size();) {
+      if (pending[k].start <= now) { sim_frame_t f = pending[k]; pending.erase(pending.begin()+k); frame_start(&f); }
+      else k++;
+    }
+
+    if (now >= next_util) {
+      for (int i = 0; i < n_nodes; i++) node_update_airtime(&nodes[i], now);
+      next_util += UTIL_UPDATE_INTERVAL_MS;
+    }
+
+    for (int i = 0; i < n_nodes; i++) {
+      sim_node_t *node = &nodes[i];
+      if (node->busy_until > now || node->queue.empty()) continue;
+
+      bool medium_free = true;
+      for (const sim_frame_t &f : active) {
+        if (f.src != i && rssi[f.src][i] >= sens && now-f.start >= dcd_delay_ms) { medium_free = false; break; }
+      }
+
+      if (csma_step(&node->csma, now, medium_free, slot_ms, difs_ms, node->cw_min, node->cw_max, sim_random)) {
+        uint32_t at = now;
+        bool should_flush = !limit_rate && !guard_rate;
+        do {
+          sim_packet_t pkt = node->queue.front(); node->queue.pop_front();
+          at = transmit(i, at, &pkt);
+          node->stat_sent++;
+        } while (should_flush && !node->queue.empty());
+        node->busy_until = at;
+        node_update_airtime(node, at);
+      }
+    }
+
+    // Skip ahead while nothing is happening on the
+    // channel and all queues are empty
+    uint32_t next = now+1;
+    if (active.empty() && pending.empty()) {
+      bool idle = true;
+      uint32_t next_arrival = duration_ms;
+      for (sim_node_t &node : nodes) {
+        if (!node.queue.empty()) { idle = false; break; }
+        next_arrival = std::min(next_arrival, node.next_arrival);
+      }
+      if (idle) next = std::max(next, std::min(next_arrival, next_util));
+    }
+    now = next;
+  }
+
+  sim_result_t r; memset(&r, 0, sizeof(r));
+  double sum = 0.0, sum_sq = 0.0; int active_nodes = 0;
+  for (sim_node_t &node : nodes) {
+    r.offered += node.stat_offered; r.dropped += node.stat_dropped;
+    r.sent += node.stat_sent; r.delivered += node.stat_delivered;
+    if (node.stat_offered > 0) {
+      double share = (double)node.stat_delivered/(double)node.stat_offered;
+      sum += share; sum_sq += share*share; active_nodes++;
+    }
+    r.goodput_bps += node.stat_delivered_bytes*8.0;
+  }
+  r.goodput_bps /= duration_ms/1000.0;
+  r.throughput = r.delivered*packet_airtime_ms/duration_ms;
+  r.jain = (sum_sq > 0.0) ? (sum*sum)/(active_nodes*sum_sq) : 1.0;
+  r.frames = frames; r.collided = collided;
+  memcpy(r.lost, lost, sizeof(r.lost));
+
+  // Packets still on the air when the run ends
+  for (const sim_frame_t &f : pending) if (f.last) r.truncated++;
+  for (const sim_frame_t &f : active) if (f.last) r.truncated++;
+
+  latency_percentiles(&latencies, &r);
+  double wall_ms = 1000.0*(double)(clock()-wall_start)/CLOCKS_PER_SEC;
+  r.speedup = duration_ms/std::max(wall_ms, 0.001);
+  return r;
+}
+
+typedef struct {
+  uint32_t at;
+  bool     ok;
+  bool     full;
+  bool     last;
+  uint8_t  seq;
+  uint8_t  epoch;
+  uint32_t packet;
+  uint8_t  part;
+  uint32_t enqueued;
+  uint16_t len;
+} sim_delivery_t;
+
+// Point-to-point link from node 0 to node 1, where
+// every frame is lost with the given probability.
+// The sender mirrors tx_queue_handler() and the ARQ
+// handling in the firmware, and the receiver joins
+// split packets like reasm_receive() and answers
+// complete packets with ACKs when ARQ is enabled.
+// Every packet and part is numbered, so packets
+// joined from the wrong parts are caught and counted
+// as corrupt.
+static sim_result_t simulate_link(const sim_params_t *p, float loss, float load, bool arq, uint32_t duration_ms, uint32_t seed) {
+  // Arrivals and frame losses have their own random
+  // sources, so runs with and without ARQ see the
+  // same traffic
+  rng.seed(seed);
+  std::mt19937 arrivals(seed), channel(seed+1);
+  std::uniform_real_distribution<float> chance(0.0, 1.0);
+
+  sim_radio_t radio = radio_setup(p);
+  float packet_airtime_ms = packet_airtime(p, &radio);
+  float ack_airtime_ms = frame_airtime(p, &radio, HEADER_L);
+  uint32_t reasm_timeout_ms = (uint32_t)ceil(frame_airtime(p, &radio, SINGLE_MTU)) + REASM_TIMEOUT_MARGIN_MS;
+  uint32_t timeout_ms = arq_timeout_ms(ack_airtime_ms);
+  bool should_flush = !arq && !radio.limit_rate && !radio.guard_rate;
+
+  double rate_per_ms = load/packet_airtime_ms;
+  std::exponential_distribution<double> interarrival(rate_per_ms);
+
+  sim_node_t node; node_init(&node);
+  uint32_t next_arrival = (uint32_t)interarrival(arrivals);
+  arq_state_t tx_arq = ARQ_STATE_INIT;
+  arq_state_t rx_arq = ARQ_STATE_INIT;
+  sim_packet_t current = { 0, 1, 0 };
+  std::deque<sim_delivery_t> in_flight;
+  bool ack_pending = false, ack_ok = false;
+  uint8_t ack_seq = 0; uint32_t ack_start = 0, ack_end = 0;
+  std::vector<uint32_t> latencies;
+  uint64_t frames = 0, frames_lost = 0, corrupt = 0;
+  uint32_t packets = 0;
+  bool slot_open = false; uint8_t slot_seq = 0; uint32_t slot_packet = 0, slot_started = 0;
+
+  // Sends the frames of a packet back to back, and
+  // returns when the last one ends. Without ARQ, the
+  // sequence is random like tx_header() picks it.
+  auto transmit = [&](uint32_t at, const sim_packet_t *pkt) {
+    uint16_t remaining = pkt->len + (arq ? ARQ_EPOCH_L : 0);
+    uint8_t seq = arq ? tx_arq.seq : (uint8_t)sim_random(0, 16);
+    uint8_t part = 0;
+    while (remaining > 0) {
+      uint16_t chunk = remaining > SINGLE_MTU-HEADER_L ? SINGLE_MTU-HEADER_L : remaining;
+      float airtime_ms = frame_airtime(p, &radio, chunk+HEADER_L);
+      node_add_airtime(&node, at, airtime_ms);
+      at += (uint32_t)ceil(airtime_ms);
+      remaining -= chunk; frames++;
+      bool ok = chance(channel) >= loss;
+      if (!ok) frames_lost++;
+      bool split = pkt->len + (arq ? ARQ_EPOCH_L : 0) > SINGLE_MTU-HEADER_L;
+      in_flight.push_back({ at, ok, split && chunk == SINGLE_MTU-HEADER_L, remaining == 0 || !split, seq, tx_arq.epoch, packets, part++, pkt->enqueued, pkt->len });
+    }
+    node.stat_sent++;
+    node.busy_until = at;
+    node_update_airtime(&node, at);
+    return at;
+  };
+
+  uint32_t next_util = UTIL_UPDATE_INTERVAL_MS;
+  uint32_t now = 0;
+  while (now < duration_ms) {
+    while (next_arrival <= now) {
+      node.stat_offered++;
+      if (node.queue.size() >= p->queue_max) { node.stat_dropped++; }
+      else { node.queue.push_back({ p->payload, 1, next_arrival }); }
+      next_arrival += 1+(uint32_t)interarrival(arrivals);
+    }
+
+    while (!in_flight.empty() && in_flight.front().at <= now) {
+      sim_delivery_t d = in_flight.front(); in_flight.pop_front();
+      if (!d.ok) continue;
+
+      // Split packets are joined like reasm_receive()
+      // does it, including the ARQ rule that a full
+      // frame always starts a new packet
+      bool complete = false, intact = true;
+      if (slot_open && now-slot_started > reasm_timeout_ms) slot_open = false;
+      bool joins = slot_open && slot_seq == d.seq && !(arq && d.full);
+      if (joins) {
+        slot_open = false; complete = true; intact = slot_packet == d.packet && d.part == 1;
+      } else if (d.full) {
+        slot_open = true; slot_seq = d.seq; slot_packet = d.packet; slot_started = now;
+      } else if (d.last && !d.full && d.len+(arq ? ARQ_EPOCH_L : 0) <= SINGLE_MTU-HEADER_L) {
+        complete = true;
+      }
+      if (!complete) continue;
+
+      if (!arq || arq_rx_accept(&rx_arq, d.seq, d.epoch, now)) {
+        if (!intact) { corrupt++; }
+        else {
+          node.stat_delivered++;
+          node.stat_delivered_bytes += d.len;
+          latencies.push_back(now-d.enqueued);
+        }
+      }
+      if (rx_arq.ack_due) {
+        rx_arq.ack_due = false;
+        ack_pending = true; ack_seq = rx_arq.ack_seq;
+        ack_start = now+ARQ_ACK_TURNAROUND_MS;
+        ack_end = ack_start+(uint32_t)ceil(ack_airtime_ms);
+        ack_ok = chance(channel) >= loss; frames++;
+        if (!ack_ok) frames_lost++;
+      }
+    }
+
+    if (ack_pending && ack_end <= now) {
+      ack_pending = false;
+      if (ack_ok) arq_ack_received(&tx_arq, ack_seq);
+    }
+
+    if (now >= next_util) {
+      node_update_airtime(&node, now);
+      next_util += UTIL_UPDATE_INTERVAL_MS;
+    }
+
+    if (node.busy_until <= now) {
+      bool medium_free = !(ack_pending && ack_start <= now);
+      bool hold = false;
+      if (arq) {
+        uint8_t step = arq_tx_step(&tx_arq, now, timeout_ms, p->arq_retries);
+        if (step != ARQ_IDLE) {
+          hold = true;
+          if (step == ARQ_RETRANSMIT && csma_step(&node.csma, now, medium_free, radio.slot_ms, radio.difs_ms, node.cw_min, node.cw_max, sim_random)) {
+            arq_tx_sent(&tx_arq, transmit(now, &current));
+          }
+        }
+      }
+
+      if (!hold && !node.queue.empty() && csma_step(&node.csma, now, medium_free, radio.slot_ms, radio.difs_ms, node.cw_min, node.cw_max, sim_random)) {
+        uint32_t at = now;
+        do {
+          current = node.queue.front(); node.queue.pop_front(); packets++;
+          if (arq) arq_tx_begin(&tx_arq);
+          at = transmit(at, &current);
+          if (arq) arq_tx_sent(&tx_arq, at);
+        } while (should_flush && !node.queue.empty());
+      }
+    }
+
+    // Skip ahead while the link is idle
+    uint32_t next = now+1;
+    if (node.queue.empty() && in_flight.empty() && !ack_pending && !tx_arq.waiting) {
+      next = std::max(next, std::min(next_arrival, next_util));
+    }
+    now = next;
+  }
+
+  sim_result_t r; memset(&r, 0, sizeof(r));
+  r.offered = node.stat_offered; r.dropped = node.stat_dropped;
+  r.sent = node.stat_sent; r.delivered = node.stat_delivered;
+  r.goodput_bps = node.stat_delivered_bytes*8.0/(duration_ms/1000.0);
+  r.throughput = r.delivered*packet_airtime_ms/duration_ms;
+  r.frames = frames; r.collided = frames_lost;
+  r.retransmits = tx_arq.stat_retransmits;
+  r.failed = tx_arq.stat_failed;
+  r.duplicates = rx_arq.stat_duplicates;
+  r.corrupt = corrupt;
+  latency_percentiles(&latencies, &r);
+  return r;
+}
+
+static void parse_list(const char *arg, std::vector<float> *out) {
+  out->clear();
+  char buf[256]; strncpy(buf, arg, sizeof(buf)-1); buf[sizeof(buf)-1] = 0;
+  for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) out->push_back(atof(tok));
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [options]\n", name);
+  printf("  -n LIST   Node counts to simulate (default 2,4,8,16,32)\n");
+  printf("  -g LIST   Offered loads as fractions of channel time (default 0.05,0.1,0.25,0.5,1.0)\n");
+  printf("  -t SEC    Simulated time per run in seconds (default 600)\n");
+  printf("  -s SF     Spreading factor (default 8)\n");
+  printf("  -b HZ     Bandwidth (default 125000)\n");
+  printf("  -c CR     Coding rate, 5 to 8 (default 5)\n");
+  printf("  -p TXP    TX power in dBm (default 14)\n");
+  printf("  -l LEN    Packet length in bytes (default 100)\n");
+  printf("  -a M      Side of the square nodes are placed in, in meters (default 1200)\n");
+  printf("  -e EXP    Path loss exponent (default 3.5)\n");
+  printf("  -k DB     Capture threshold in dB (default 6)\n");
+  printf("  -d SYM    Symbols until a transmission is detected by others (default 4)\n");
+  printf("  -q LEN    Transmit queue length per node (default 200)\n");
+  printf("  -x        Use SX126x/SX128x airtime rules\n");
+  printf("  -r SEED   Random seed (default 1)\n");
+  printf("  -L        Simulate a point-to-point link with and without ARQ\n");
+  printf("  -f LIST   Frame loss rates for link mode (default 0,0.05,0.1,0.2,0.3)\n");
+  printf("  -R N      ARQ retransmissions per packet in link mode (default 3)\n");
+  printf("  -C        In link mode, fail if ARQ delivered any corrupt packet\n");
+}
+
+int main(int argc, char **argv) {
+  sim_params_t p = { 8, 125000, 5, 14.0, 3.5, 1200.0, 6.0, 4, 100, 200, false, 3 };
+  std::vector<float> losses = { 0.0, 0.05, 0.1, 0.2, 0.3 };
+  bool link_mode = false, check = false, failed = false;
+  std::vector<float> counts = { 2, 4, 8, 16, 32 };
+  std::vector<float> loads = { 0.05, 0.1, 0.25, 0.5, 1.0 };
+  uint32_t duration_ms = 600*1000;
+  uint32_t seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:g:t:s:b:c:p:l:a:e:k:d:q:xr:Lf:R:Ch")) != -1) {
+    switch (opt) {
+      case 'n': parse_list(optarg, &counts); break;
+      case 'g': parse_list(optarg, &loads); break;
+      case 't': duration_ms = atoi(optarg)*1000; break;
+      case 's': p.sf = atoi(optarg); break;
+      case 'b': p.bw = atol(optarg); break;
+      case 'c': p.cr = atoi(optarg); break;
+      case 'p': p.txp = atof(optarg); break;
+      case 'l': p.payload = atoi(optarg); break;
+      case 'a': p.area_m = atof(optarg); break;
+      case 'e': p.path_loss_exp = atof(optarg); break;
+      case 'k': p.capture_db = atof(optarg); break;
+      case 'd': p.dcd_symbols = atoi(optarg); break;
+      case 'q': p.queue_max = atoi(optarg); break;
+      case 'x': p.sx126x = true; break;
+      case 'r': seed = atoi(optarg); break;
+      case 'L': link_mode = true; break;
+      case 'f': parse_list(optarg, &losses); break;
+      case 'R': p.arq_retries = atoi(optarg); break;
+      case 'C': check = true; break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (p.sf < 5 || p.sf > 12 || p.cr < 5 || p.cr > 8 || p.payload < 1 || p.payload > 508 || p.queue_max < 1) {
+    fprintf(stderr, "Invalid radio or packet parameters\n");
+    return 1;
+  }
+
+  if (link_mode) {
+    if (p.payload+ARQ_EPOCH_L > ARQ_SPLIT_MAX) {
+      fprintf(stderr, "Packets in link mode can be at most %d bytes\n", ARQ_SPLIT_MAX-ARQ_EPOCH_L);
+      return 1;
+    }
+
+    printf("SF%d, %ld Hz, CR4/%d, %d byte packets, %u s per run, point-to-point link, %d ARQ retries\n\n", p.sf, p.bw, p.cr, p.payload, duration_ms/1000, p.arq_retries);
+    printf("%6s %6s %4s %8s %8s %8s %10s %8s %8s %8s %7s %7s %7s %7s\n",
+           "loss", "load", "arq", "offered", "sent", "deliv", "goodput", "p50", "p90", "p99", "retx", "failed", "dups", "corrupt");
+    for (float f : losses) {
+      for (float g : loads) {
+        for (int arq = 0; arq <= 1; arq++) {
+          sim_result_t r = simulate_link(&p, f, g, arq, duration_ms, seed);
+          printf("%5.1f%% %6.2f %4s %8llu %8llu %8llu %7.0fbps %6ums %6ums %6ums %7u %7u %7u %7u\n",
+                 f*100.0, g, arq ? "on" : "off", (unsigned long long)r.offered, (unsigned long long)r.sent, (unsigned long long)r.delivered,
+                 r.goodput_bps, r.p50, r.p90, r.p99, r.retransmits, r.failed, r.duplicates, r.corrupt);
+          if (check && arq && r.corrupt > 0) { failed = true; }
+        }
+      }
+    }
+    return failed ? 1 : 0;
+  }
+
+  printf("SF%d, %ld Hz, CR4/%d, %d byte packets, %u s per run\n\n", p.sf, p.bw, p.cr, p.payload, duration_ms/1000);
+  printf("Undelivered packets are counted by cause in l_coll (collision),\n");
+  printf("l_hdx (half-duplex), l_rng (out of range) and l_end (still on the\n");
+  printf("air when the run ended). coll is the share of collided frames.\n\n");
+  printf("%5s %6s %8s %8s %8s %6s %6s %6s %6s %10s %7s %7s %8s %8s %8s %6s %8s\n",
+         "nodes", "load", "offered", "sent", "deliv", "l_coll", "l_hdx", "l_rng", "l_end", "goodput", "S", "coll", "p50", "p90", "p99", "jain", "speedup");
+  for (float n : counts) {
+    for (float g : loads) {
+      sim_result_t r = simulate(&p, (int)n, g, duration_ms, seed);
+      double coll = r.frames > 0 ? (double)r.collided/(double)r.frames : 0.0;
+      printf("%5d %6.2f %8llu %8llu %8llu %6llu %6llu %6llu %6llu %7.0fbps %7.3f %6.1f%% %6ums %6ums %6ums %6.3f %7.0fx\n",
+             (int)n, g, (unsigned long long)r.offered, (unsigned long long)r.sent, (unsigned long long)r.delivered,
+             (unsigned long long)r.lost[LOSS_COLLISION], (unsigned long long)r.lost[LOSS_HALF_DUPLEX],
+             (unsigned long long)r.lost[LOSS_RANGE], (unsigned long long)r.truncated,
+             r.goodput_bps, r.throughput, coll*100.0, r.p50, r.p90, r.p99, r.jain, r.speedup);
+    }
+  }
+
+  return 0;
+}
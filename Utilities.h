@@ -23,8 +23,31 @@
     #include <InternalFileSystem.h>
     using namespace Adafruit_LittleFS_Namespace;
     #define EEPROM_FILE "eeprom"
-    bool file_exists = false;
-    int written_bytes = 4;
+    #define EEPROM_FILE_A "eeprom_a"
+    #define EEPROM_FILE_B "eeprom_b"
+    #define EEPROM_IMG_MAGIC 0x52454550
+    #define EEPROM_FLUSH_DELAY_MS 2000
+    #define CONFIG_FILE "config"
+    #define CONFIG_FILE_TMP "config.tmp"
+
+    // The EEPROM image is held entirely in RAM, and written
+    // out as a whole to alternating slot files. Every slot
+    // carries a generation counter and a CRC, so the newest
+    // intact slot can always be found at boot, even if
+    // power was lost halfway through writing the other.
+    typedef struct {
+      uint32_t magic;
+      uint32_t generation;
+      uint16_t size;
+      uint16_t crc;
+    } eeprom_img_hdr_t;
+
+    uint8_t eeprom_img[EEPROM_SIZE];
+    uint32_t eeprom_img_generation = 0;
+    uint8_t eeprom_img_slot = 0;
+    bool eeprom_img_dirty = false;
+    bool device_config_file_dirty = false;
+    uint32_t eeprom_img_dirty_since = 0;
     File file(InternalFS);
 #endif
 #include <stddef.h>
@@ -152,17 +175,9 @@ uint8_t boot_vector = 0x00;
   		digitalWrite(PIN_VEXT_EN, HIGH);
   	#endif
 
-    #if MCU_VARIANT == MCU_NRF52
-      if (eeprom_read(eeprom_addr(ADDR_CONF_PSET)) == CONF_OK_BYTE) {
-        uint8_t int_val = eeprom_read(eeprom_addr(ADDR_CONF_PINT));
-        led_set_intensity(int_val);
-      }
-    #else
-    if (EEPROM.read(eeprom_addr(ADDR_CONF_PSET)) == CONF_OK_BYTE) {
-        uint8_t int_val = EEPROM.read(eeprom_addr(ADDR_CONF_PINT));
-        led_set_intensity(int_val);
+    if (device_config.np_set == CONF_OK_BYTE) {
+        led_set_intensity(device_config.np_int);
     }
-    #endif
   }
 
   void npset(uint8_t r, uint8_t g, uint8_t b) {
@@ -383,6 +398,9 @@ void hard_reset(void) {
 	#elif MCU_VARIANT == MCU_ESP32
 		ESP.restart();
 	#elif MCU_VARIANT == MCU_NRF52
+    #if !HAS_EEPROM
+      eeprom_flush();
+    #endif
     NVIC_SystemReset();
 	#endif
 }
@@ -811,8 +829,13 @@ void serial_write(uint8_t byte) {
 			SerialBT.write(byte);
       #if MCU_VARIANT == MCU_NRF52 && HAS_BLE
 	      // This ensures that the TX buffer is flushed after a frame is queued in serial.
-	      // serial_in_frame is used to ensure that the flush only happens at the end of the frame
-	      if (serial_in_frame && byte == FEND) { SerialBT.flushTXD(); serial_in_frame = false; }
+	      // serial_in_frame is used to ensure that the flush only happens at the end of the frame.
+	      // If the host has enabled coalescing, the remainder is instead flushed from update_bt
+	      // once no further frame follows shortly after, so bursts of frames share notifications.
+	      if (serial_in_frame && byte == FEND) {
+	        if (ble_link_opts & BLE_LINK_OPT_COALESCE) { bt_tx_frame_end(); } else { SerialBT.flushTXD(); }
+	        serial_in_frame = false;
+	      }
 	      else if (!serial_in_frame && byte == FEND) { serial_in_frame = true; }
       #endif
 		}
@@ -876,6 +899,97 @@ void kiss_indicate_stat_rssi() {
 	serial_write(FEND);
 }
 
+// While a transmit batch is open, frames written to
+// the host are held back and handed to the transport
+// in one write when the batch ends
+void kiss_tx_batch_begin() {
+	#if HAS_WIFI
+		wr_tx_hold = true;
+	#endif
+}
+
+void kiss_tx_batch_end() {
+	#if HAS_WIFI
+		wr_tx_hold = false;
+		if (wr_transport == WR_TRANSPORT_TCP && wr_tx_len > 0) wifi_remote_flush();
+	#endif
+	#if MCU_VARIANT == MCU_ESP32 && HAS_BLE
+		bt_flush();
+	#endif
+}
+
+void kiss_indicate_cad() {
+	uint8_t enabled = 0x00; uint32_t stats[2] = {0, 0};
+	#if HAS_CAD
+		enabled = cad_enabled ? 0x01 : 0x00;
+		stats[0] = cad_scans; stats[1] = cad_detections;
+	#endif
+	serial_write(FEND);
+	serial_write(CMD_CAD);
+	escaped_serial_write(enabled);
+	escaped_serial_write(HAS_CAD ? 0x01 : 0x00);
+	for (uint8_t i = 0; i < 2; i++) {
+		escaped_serial_write(stats[i]>>24);
+		escaped_serial_write(stats[i]>>16);
+		escaped_serial_write(stats[i]>>8);
+		escaped_serial_write(stats[i]);
+	}
+	serial_write(FEND);
+}
+
+void kiss_indicate_arq() {
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+		uint32_t stats[4] = { arq_state.stat_acked, arq_state.stat_retransmits, arq_state.stat_failed, arq_state.stat_duplicates };
+		serial_write(FEND);
+		serial_write(CMD_ARQ);
+		escaped_serial_write(arq_enabled ? 0x01 : 0x00);
+		escaped_serial_write(arq_retries);
+		for (uint8_t i = 0; i < 4; i++) {
+			escaped_serial_write(stats[i]>>24);
+			escaped_serial_write(stats[i]>>16);
+			escaped_serial_write(stats[i]>>8);
+			escaped_serial_write(stats[i]);
+		}
+		serial_write(FEND);
+	#endif
+}
+
+void kiss_indicate_aggregate() {
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+		serial_write(FEND);
+		serial_write(CMD_AGGREGATE);
+		escaped_serial_write(aggr_window_ms>>8);
+		escaped_serial_write(aggr_window_ms);
+		serial_write(FEND);
+	#endif
+}
+
+uint16_t host_mtu();
+
+// Builds without fragmentation support report zero
+// segments, so the host knows it cannot be enabled
+void kiss_indicate_frag_mode() {
+	uint8_t enabled = 0x00; uint8_t segments = 0; uint16_t mtu = host_mtu();
+	#if HAS_FRAG
+		enabled = frag_mode ? 0x01 : 0x00;
+		segments = FRAG_MAX_SEGMENTS;
+	#endif
+	serial_write(FEND);
+	serial_write(CMD_FRAG_MODE);
+	escaped_serial_write(enabled);
+	escaped_serial_write(segments);
+	escaped_serial_write(mtu>>8);
+	escaped_serial_write(mtu);
+	serial_write(FEND);
+}
+
+void kiss_indicate_rx_ext() {
+	serial_write(FEND);
+	serial_write(CMD_DATA_EXT);
+	serial_write(rx_ext ? 0x01 : 0x00);
+	serial_write(FEND);
+}
+
 void kiss_indicate_stat_snr() {
 	serial_write(FEND);
 	serial_write(CMD_STAT_SNR);
@@ -956,6 +1070,31 @@ void kiss_indicate_lt_alock() {
 	serial_write(FEND);
 }
 
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+	// Reports the time until the head of the queue
+	// fits within the airtime budgets, along with the
+	// remaining budgets in milliseconds of airtime
+	void kiss_indicate_airtime_budget() {
+		int32_t st = (int32_t)st_airtime_tokens;
+		int32_t lt = (int32_t)lt_airtime_tokens;
+		serial_write(FEND);
+		serial_write(CMD_STAT_ATBGT);
+		escaped_serial_write(airtime_wait>>24);
+		escaped_serial_write(airtime_wait>>16);
+		escaped_serial_write(airtime_wait>>8);
+		escaped_serial_write(airtime_wait);
+		escaped_serial_write(st>>24);
+		escaped_serial_write(st>>16);
+		escaped_serial_write(st>>8);
+		escaped_serial_write(st);
+		escaped_serial_write(lt>>24);
+		escaped_serial_write(lt>>16);
+		escaped_serial_write(lt>>8);
+		escaped_serial_write(lt);
+		serial_write(FEND);
+	}
+#endif
+
 void kiss_indicate_channel_stats() {
 	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
 		uint16_t ats = (uint16_t)(airtime*100*100);
@@ -1048,6 +1187,53 @@ void kiss_indicate_btpin() {
 	#endif
 }
 
+void kiss_indicate_bt_link() {
+	#if HAS_BLE == true
+		uint16_t interval = ble_link_interval;
+		uint16_t latency = ble_link_latency;
+		uint16_t timeout = ble_link_timeout;
+		uint16_t mtu = ble_link_mtu;
+		uint16_t data_len = ble_link_data_len;
+		// Bytes dropped because the BLE RX buffer was full,
+		// which only the ESP32 BLESerial keeps count of
+		uint32_t rx_overflows = 0;
+		#if MCU_VARIANT == MCU_ESP32
+			rx_overflows = SerialBT.rxOverflows();
+		#endif
+		serial_write(FEND);
+		serial_write(CMD_BT_LINK);
+		escaped_serial_write(interval>>8);
+		escaped_serial_write(interval);
+		escaped_serial_write(latency>>8);
+		escaped_serial_write(latency);
+		escaped_serial_write(timeout>>8);
+		escaped_serial_write(timeout);
+		escaped_serial_write(mtu>>8);
+		escaped_serial_write(mtu);
+		escaped_serial_write(data_len>>8);
+		escaped_serial_write(data_len);
+		escaped_serial_write(ble_link_phy);
+		escaped_serial_write(ble_link_opts);
+		escaped_serial_write(rx_overflows>>24);
+		escaped_serial_write(rx_overflows>>16);
+		escaped_serial_write(rx_overflows>>8);
+		escaped_serial_write(rx_overflows);
+		serial_write(FEND);
+	#endif
+}
+
+void kiss_indicate_wifi_transport() {
+	#if HAS_WIFI
+		serial_write(FEND);
+		serial_write(CMD_WIFI_TRSP);
+		escaped_serial_write(wr_transport);
+		for (uint8_t i = 0; i < 4; i++) { escaped_serial_write(wr_peer_known || wr_peer_static ? wr_peer_ip[i] : 0x00); }
+		escaped_serial_write(wr_peer_port>>8);
+		escaped_serial_write(wr_peer_port);
+		serial_write(FEND);
+	#endif
+}
+
 void kiss_indicate_random(uint8_t byte) {
 	serial_write(FEND);
 	serial_write(CMD_RANDOM);
@@ -1124,6 +1310,88 @@ void kiss_indicate_fbstate() {
 	  }
 	  serial_write(FEND);
 	}
+
+	void kiss_indicate_hash_stats() {
+	  serial_write(FEND);
+	  serial_write(CMD_HASHES);
+	  serial_write(0x05);
+	  escaped_serial_write(dev_hash_bytes>>24);
+	  escaped_serial_write(dev_hash_bytes>>16);
+	  escaped_serial_write(dev_hash_bytes>>8);
+	  escaped_serial_write(dev_hash_bytes);
+	  escaped_serial_write(dev_hash_time_us>>24);
+	  escaped_serial_write(dev_hash_time_us>>16);
+	  escaped_serial_write(dev_hash_time_us>>8);
+	  escaped_serial_write(dev_hash_time_us);
+	  serial_write(FEND);
+	}
+#endif
+
+#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+	// Boot trace. Each entry records the time in
+	// milliseconds since reset at which a setup
+	// phase completed. The trace is sent to the
+	// host as CMD_LOG frames on the first detect
+	// request, and again on request.
+	#define LOG_BOOT_TRACE      0x01
+
+	#define BOOT_PH_START       0x00
+	#define BOOT_PH_EEPROM      0x01
+	#define BOOT_PH_CONFIG      0x02
+	#define BOOT_PH_SERIAL      0x03
+	#define BOOT_PH_MODEM       0x04
+	#define BOOT_PH_DISPLAY     0x05
+	#define BOOT_PH_PMU         0x06
+	#define BOOT_PH_BT          0x07
+	#define BOOT_PH_WIFI        0x08
+	#define BOOT_PH_DEVICE_INIT 0x09
+	#define BOOT_PH_RADIO       0x0A
+	#define BOOT_PH_STATUS      0x0B
+	#define BOOT_PH_DONE        0x0C
+
+	#define BOOT_TRACE_LEN 16
+
+	typedef struct {
+		uint8_t phase;
+		uint32_t ms;
+	} boot_trace_t;
+
+	boot_trace_t boot_trace_buf[BOOT_TRACE_LEN];
+	uint8_t boot_trace_len = 0;
+	bool boot_trace_open = true;
+	bool boot_trace_sent = false;
+
+	void boot_trace(uint8_t phase) {
+		if (boot_trace_open && boot_trace_len < BOOT_TRACE_LEN) {
+			boot_trace_buf[boot_trace_len].phase = phase;
+			boot_trace_buf[boot_trace_len].ms = millis();
+			boot_trace_len++;
+		}
+	}
+
+	void boot_trace_close() {
+		boot_trace(BOOT_PH_DONE);
+		boot_trace_open = false;
+	}
+
+	void kiss_indicate_boot_trace() {
+		for (uint8_t i = 0; i < boot_trace_len; i++) {
+			uint32_t ms = boot_trace_buf[i].ms;
+			serial_write(FEND);
+			serial_write(CMD_LOG);
+			serial_write(LOG_BOOT_TRACE);
+			escaped_serial_write(boot_trace_buf[i].phase);
+			escaped_serial_write(ms>>24);
+			escaped_serial_write(ms>>16);
+			escaped_serial_write(ms>>8);
+			escaped_serial_write(ms);
+			serial_write(FEND);
+		}
+		boot_trace_sent = true;
+	}
+#else
+	#define boot_trace(phase)
+	#define boot_trace_close()
 #endif
 
 void kiss_indicate_fb() {
@@ -1154,6 +1422,14 @@ void kiss_indicate_disp() {
 	serial_write(FEND);
 }
 
+void kiss_indicate_batch(uint8_t status, uint8_t count) {
+	serial_write(FEND);
+	serial_write(CMD_DATA_BATCH);
+	serial_write(status);
+	serial_write(count);
+	serial_write(FEND);
+}
+
 void kiss_indicate_ready() {
 	serial_write(FEND);
 	serial_write(CMD_READY);
@@ -1241,15 +1517,11 @@ void updateBitrate() {
 			lora_limit_rate  = lora_bitrate > LORA_LIMIT_THRESHOLD_BPS;
 			lora_guard_rate  = (!lora_limit_rate && lora_bitrate > LORA_GUARD_THRESHOLD_BPS);
 
-			int csma_slot_min_ms = CSMA_SLOT_MIN_MS;
 			float lora_preamble_target_ms = LORA_PREAMBLE_TARGET_MS;
-			if (fast_rate) { csma_slot_min_ms        -= CSMA_SLOT_MIN_FAST_DELTA;
-											 lora_preamble_target_ms -= LORA_PREAMBLE_FAST_DELTA; }
+			if (fast_rate) { lora_preamble_target_ms -= LORA_PREAMBLE_FAST_DELTA; }
 			
-			csma_slot_ms = lora_symbol_time_ms*CSMA_SLOT_SYMBOLS;
-			if (csma_slot_ms > CSMA_SLOT_MAX_MS) { csma_slot_ms = CSMA_SLOT_MAX_MS; }
-			if (csma_slot_ms < CSMA_SLOT_MIN_MS) { csma_slot_ms = csma_slot_min_ms; }
-			difs_ms = CSMA_SIFS_MS + 2*csma_slot_ms;
+			csma_slot_ms = csma_slot_time_ms(&csma_profile, lora_symbol_time_ms, fast_rate);
+			difs_ms = csma_difs_time_ms(&csma_profile, csma_slot_ms);
 			
 			float target_preamble_symbols = lora_preamble_target_ms/lora_symbol_time_ms;
 			if (target_preamble_symbols < LORA_PREAMBLE_SYMBOLS_MIN) { target_preamble_symbols = LORA_PREAMBLE_SYMBOLS_MIN; }
@@ -1258,6 +1530,10 @@ void updateBitrate() {
 			lora_preamble_symbols = (long)target_preamble_symbols; setPreamble();
 			lora_preamble_time_ms = (ceil)(lora_preamble_symbols * lora_symbol_time_ms);
 			lora_header_time_ms   = (ceil)(PHY_HEADER_LORA_SYMBOLS * lora_symbol_time_ms);
+
+			float frame_time_ms   = lora_frame_airtime_ms(SINGLE_MTU, lora_sf, lora_cr, lora_preamble_symbols, lora_symbol_time_ms, lora_low_datarate, MODEM == SX1262 || MODEM == SX1280);
+			reasm_timeout_ms      = (uint32_t)(ceil)(frame_time_ms) + REASM_TIMEOUT_MARGIN_MS;
+			arq_timeout           = arq_timeout_ms(lora_frame_airtime_ms(HEADER_L, lora_sf, lora_cr, lora_preamble_symbols, lora_symbol_time_ms, lora_low_datarate, MODEM == SX1262 || MODEM == SX1280));
 		}
 	#endif
 }
@@ -1446,32 +1722,134 @@ void promisc_disable() {
 	promisc = false;
 }
 
+uint16_t crc16(const uint8_t *data, size_t len) {
+	// CRC-16/CCITT-FALSE
+	uint16_t crc = 0xFFFF;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (uint8_t b = 0; b < 8; b++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+// Writes that change several bytes at once should be
+// wrapped in a transaction, so that the backing flash is
+// committed once for the whole change, rather than once
+// for every changed byte. Transactions can be nested, and
+// only the outermost commit writes anything out.
+uint8_t eeprom_txn_depth = 0;
+bool eeprom_txn_dirty = false;
+
 #if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
+  const char *eeprom_slot_path(uint8_t slot) { return slot == 0 ? EEPROM_FILE_A : EEPROM_FILE_B; }
+
+  bool eeprom_slot_load(uint8_t slot, uint8_t *img, uint32_t *generation) {
+    bool valid = false;
+    if (file.open(eeprom_slot_path(slot), FILE_O_READ)) {
+      eeprom_img_hdr_t hdr;
+      if (file.read(&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == EEPROM_IMG_MAGIC && hdr.size == EEPROM_SIZE) {
+        if (file.read(img, EEPROM_SIZE) == EEPROM_SIZE && crc16(img, EEPROM_SIZE) == hdr.crc) {
+          *generation = hdr.generation;
+          valid = true;
+        }
+      }
+      file.close();
+    }
+    return valid;
+  }
+
+  bool eeprom_slot_write(uint8_t slot, uint32_t generation) {
+    eeprom_img_hdr_t hdr;
+    hdr.magic = EEPROM_IMG_MAGIC;
+    hdr.generation = generation;
+    hdr.size = EEPROM_SIZE;
+    hdr.crc = crc16(eeprom_img, EEPROM_SIZE);
+
+    const char *path = eeprom_slot_path(slot);
+    if (InternalFS.exists(path)) { InternalFS.remove(path); }
+    if (!file.open(path, FILE_O_WRITE)) { return false; }
+    bool ok = file.write((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+              file.write(eeprom_img, EEPROM_SIZE) == EEPROM_SIZE;
+    file.close();
+    return ok;
+  }
+
+  // The config block is written to a temporary file that
+  // is then renamed over the old one. LittleFS renames are
+  // atomic, so the previous config stays intact on flash
+  // until the new one is completely written.
+  bool device_config_file_write() {
+    if (InternalFS.exists(CONFIG_FILE_TMP)) { InternalFS.remove(CONFIG_FILE_TMP); }
+    if (!file.open(CONFIG_FILE_TMP, FILE_O_WRITE)) { return false; }
+    bool ok = file.write((uint8_t*)&device_config, sizeof(device_config_t)) == sizeof(device_config_t);
+    file.close();
+    if (!ok) { InternalFS.remove(CONFIG_FILE_TMP); return false; }
+    return InternalFS.rename(CONFIG_FILE_TMP, CONFIG_FILE);
+  }
+
+  void eeprom_flush() {
+    if (device_config_file_dirty) {
+      if (device_config_file_write()) { device_config_file_dirty = false; }
+    }
+    if (eeprom_img_dirty) {
+      // Always overwrite the slot not holding the newest
+      // image, so that one intact copy remains on flash
+      uint8_t slot = eeprom_img_slot ^ 0x01;
+      if (eeprom_slot_write(slot, eeprom_img_generation+1)) {
+        eeprom_img_slot = slot;
+        eeprom_img_generation++;
+        eeprom_img_dirty = false;
+      }
+    }
+  }
+
+  void eeprom_mark_dirty() {
+    if (!eeprom_img_dirty) { eeprom_img_dirty = true; eeprom_img_dirty_since = millis(); }
+  }
+
   bool eeprom_begin() {
     InternalFS.begin();
 
-    file.open(EEPROM_FILE, FILE_O_READ);
-    if (!file) {
-      if (file.open(EEPROM_FILE, FILE_O_WRITE)) {
-      	for (uint32_t mapped_addr = 0; mapped_addr < EEPROM_SIZE; mapped_addr++) { file.seek(mapped_addr); file.write(0xFF); }
-        eeprom_flush();
-        return true;
-      } else {
-        return false;
-      }
-    } else {
-      file.close();
-      file.open(EEPROM_FILE, FILE_O_WRITE);
+    static uint8_t img_b[EEPROM_SIZE];
+    uint32_t gen_a = 0; uint32_t gen_b = 0;
+    bool valid_a = eeprom_slot_load(0, eeprom_img, &gen_a);
+    bool valid_b = eeprom_slot_load(1, img_b, &gen_b);
+
+    if (valid_b && (!valid_a || gen_b > gen_a)) {
+      memcpy(eeprom_img, img_b, EEPROM_SIZE);
+      eeprom_img_slot = 1; eeprom_img_generation = gen_b;
+      return true;
+    } else if (valid_a) {
+      eeprom_img_slot = 0; eeprom_img_generation = gen_a;
       return true;
     }
+
+    // No valid slot exists yet, so migrate the image from the
+    // legacy single-file layout if present, or start blank
+    memset(eeprom_img, 0xFF, EEPROM_SIZE);
+    if (file.open(EEPROM_FILE, FILE_O_READ)) {
+      file.read(eeprom_img, EEPROM_SIZE);
+      file.close();
+    }
+    eeprom_img_slot = 1; eeprom_img_generation = 0;
+    eeprom_img_dirty = true;
+    eeprom_flush();
+    return !eeprom_img_dirty;
   }
 
   uint8_t eeprom_read(uint32_t mapped_addr) {
-      uint8_t byte;
-      void* byte_ptr = &byte;
-      file.seek(mapped_addr);
-      file.read(byte_ptr, 1);
-      return byte;
+    if (mapped_addr < EEPROM_SIZE) { return eeprom_img[mapped_addr]; }
+    else                           { return 0xFF; }
+  }
+
+  // Retries image writes that failed, once the image
+  // has been left dirty for EEPROM_FLUSH_DELAY_MS
+  void update_eeprom() {
+    if (eeprom_img_dirty && eeprom_txn_depth == 0 && millis()-eeprom_img_dirty_since >= EEPROM_FLUSH_DELAY_MS) {
+      eeprom_flush();
+    }
   }
 #endif
 
@@ -1544,38 +1922,243 @@ void kiss_dump_config() {
 	serial_write(FEND);
 }
 
-#if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
-void eeprom_flush() {
-    file.close();
-    file.open(EEPROM_FILE, FILE_O_WRITE);
-    written_bytes = 0;
-}
+// Maps the legacy per-byte settings in the ROM.h layout to
+// their place in the config block. Every write to one of
+// these addresses is mirrored into the block, so the two
+// can never disagree, whichever path the write came in on.
+typedef struct {
+	uint8_t addr;
+	uint8_t offset;
+	uint8_t len;
+} conf_map_t;
+
+const conf_map_t conf_eeprom_map[] = {
+	{ADDR_CONF_SF,   offsetof(device_config_t, conf_sf),        1},
+	{ADDR_CONF_CR,   offsetof(device_config_t, conf_cr),        1},
+	{ADDR_CONF_TXP,  offsetof(device_config_t, conf_txp),       1},
+	{ADDR_CONF_BW,   offsetof(device_config_t, conf_bw),        4},
+	{ADDR_CONF_FREQ, offsetof(device_config_t, conf_freq),      4},
+	{ADDR_CONF_OK,   offsetof(device_config_t, conf_ok),        1},
+	{ADDR_CONF_BT,   offsetof(device_config_t, bt),             1},
+	{ADDR_CONF_DSET, offsetof(device_config_t, disp_set),       1},
+	{ADDR_CONF_DINT, offsetof(device_config_t, disp_int),       1},
+	{ADDR_CONF_DADR, offsetof(device_config_t, disp_addr),      1},
+	{ADDR_CONF_DBLK, offsetof(device_config_t, disp_blank),     1},
+	{ADDR_CONF_PSET, offsetof(device_config_t, np_set),         1},
+	{ADDR_CONF_PINT, offsetof(device_config_t, np_int),         1},
+	{ADDR_CONF_BSET, offsetof(device_config_t, disp_blank_set), 1},
+	{ADDR_CONF_DROT, offsetof(device_config_t, disp_rot),       1},
+	{ADDR_CONF_DIA,  offsetof(device_config_t, dis_ia),         1},
+	{ADDR_CONF_WIFI, offsetof(device_config_t, wifi_mode),      1},
+	{ADDR_CONF_WCHN, offsetof(device_config_t, wifi_chn),       1},
+	{ADDR_CONF_WTRP, offsetof(device_config_t, wifi_transport), 1},
+};
+
+#if MCU_VARIANT == MCU_ESP32
+const conf_map_t conf_config_map[] = {
+	{ADDR_CONF_SSID, offsetof(device_config_t, wifi_ssid),      33},
+	{ADDR_CONF_PSK,  offsetof(device_config_t, wifi_psk),       33},
+	{ADDR_CONF_IP,   offsetof(device_config_t, wifi_ip),        4},
+	{ADDR_CONF_NM,   offsetof(device_config_t, wifi_nm),        4},
+	{ADDR_CONF_WPR,  offsetof(device_config_t, wifi_peer),      6},
+};
 #endif
 
-void eeprom_update(int mapped_addr, uint8_t byte) {
+#if MCU_VARIANT == MCU_ESP32
+	static_assert(sizeof(device_config_t) <= CONFIG_SIZE-ADDR_CONF_BLOCK, "Config block does not fit in config area");
+#endif
+
+bool device_config_dirty = false;
+
+uint8_t conf_legacy_read(int mapped_addr) {
+	#if HAS_EEPROM
+		return EEPROM.read(mapped_addr);
+	#elif MCU_VARIANT == MCU_NRF52
+		return eeprom_read(mapped_addr);
+	#endif
+}
+
+void eeprom_store_byte(int mapped_addr, uint8_t byte) {
 	#if MCU_VARIANT == MCU_1284P || MCU_VARIANT == MCU_2560
 		EEPROM.update(mapped_addr, byte);
 	#elif MCU_VARIANT == MCU_ESP32
 		if (EEPROM.read(mapped_addr) != byte) {
 			EEPROM.write(mapped_addr, byte);
-			EEPROM.commit();
+			eeprom_txn_dirty = true;
 		}
   #elif !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
-    // todo: clean up this implementation, writing one byte and syncing
-    // each time is really slow, but this is also suboptimal
-    uint8_t read_byte;
-    void* read_byte_ptr = &read_byte;
-    file.seek(mapped_addr);
-    file.read(read_byte_ptr, 1);
-    file.seek(mapped_addr);
-    if (read_byte != byte) {
-      file.write(byte);
+    if (mapped_addr >= 0 && mapped_addr < EEPROM_SIZE && eeprom_img[mapped_addr] != byte) {
+      eeprom_img[mapped_addr] = byte;
+      eeprom_mark_dirty();
+      eeprom_txn_dirty = true;
     }
-    written_bytes++;
-    eeprom_flush();
 	#endif
 }
 
+uint16_t device_config_crc() {
+	return crc16((uint8_t*)&device_config, offsetof(device_config_t, crc));
+}
+
+void device_config_mirror(int mapped_addr, uint8_t byte) {
+	uint8_t *conf = (uint8_t*)&device_config;
+	int addr = mapped_addr-eeprom_addr(0);
+	if (addr >= 0 && addr < EEPROM_RESERVED) {
+		for (uint8_t i = 0; i < sizeof(conf_eeprom_map)/sizeof(conf_map_t); i++) {
+			const conf_map_t *m = &conf_eeprom_map[i];
+			if (addr >= m->addr && addr < m->addr+m->len) {
+				if (conf[m->offset+addr-m->addr] != byte) { conf[m->offset+addr-m->addr] = byte; device_config_dirty = true; }
+				return;
+			}
+		}
+	}
+
+	#if MCU_VARIANT == MCU_ESP32
+		addr = mapped_addr-config_addr(0);
+		if (addr >= 0 && addr < ADDR_CONF_BLOCK) {
+			for (uint8_t i = 0; i < sizeof(conf_config_map)/sizeof(conf_map_t); i++) {
+				const conf_map_t *m = &conf_config_map[i];
+				if (addr >= m->addr && addr < m->addr+m->len) {
+					if (conf[m->offset+addr-m->addr] != byte) { conf[m->offset+addr-m->addr] = byte; device_config_dirty = true; }
+					return;
+				}
+			}
+		}
+	#endif
+}
+
+void device_config_store() {
+	device_config.magic = DEVICE_CONFIG_MAGIC;
+	device_config.version = DEVICE_CONFIG_VERSION;
+	device_config.length = sizeof(device_config_t);
+	device_config.crc = device_config_crc();
+	#if MCU_VARIANT == MCU_ESP32
+		uint8_t *conf = (uint8_t*)&device_config;
+		for (uint16_t i = 0; i < sizeof(device_config_t); i++) { eeprom_store_byte(config_addr(ADDR_CONF_BLOCK+i), conf[i]); }
+	#elif !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
+		device_config_file_dirty = true;
+		eeprom_mark_dirty();
+		eeprom_txn_dirty = true;
+	#endif
+	device_config_dirty = false;
+}
+
+void eeprom_transaction_finish() {
+	if (device_config_dirty) { device_config_store(); }
+	if (eeprom_txn_dirty) {
+		eeprom_txn_dirty = false;
+		#if MCU_VARIANT == MCU_ESP32
+			EEPROM.commit();
+		#elif !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
+			eeprom_flush();
+		#endif
+	}
+}
+
+void eeprom_transaction_begin() {
+	eeprom_txn_depth++;
+}
+
+void eeprom_transaction_commit() {
+	if (eeprom_txn_depth > 0) eeprom_txn_depth--;
+	if (eeprom_txn_depth == 0) { eeprom_transaction_finish(); }
+}
+
+void eeprom_update(int mapped_addr, uint8_t byte) {
+	eeprom_store_byte(mapped_addr, byte);
+	device_config_mirror(mapped_addr, byte);
+	if (eeprom_txn_depth == 0) { eeprom_transaction_finish(); }
+}
+
+void device_config_migrate() {
+	// Builds the config block from the legacy layout. This
+	// runs once on devices upgrading from firmware that did
+	// not have the block, and whenever the block is corrupt.
+	uint8_t *conf = (uint8_t*)&device_config;
+	memset(conf, 0xFF, sizeof(device_config_t));
+	for (uint8_t i = 0; i < sizeof(conf_eeprom_map)/sizeof(conf_map_t); i++) {
+		const conf_map_t *m = &conf_eeprom_map[i];
+		for (uint8_t j = 0; j < m->len; j++) { conf[m->offset+j] = conf_legacy_read(eeprom_addr(m->addr+j)); }
+	}
+	#if MCU_VARIANT == MCU_ESP32
+		for (uint8_t i = 0; i < sizeof(conf_config_map)/sizeof(conf_map_t); i++) {
+			const conf_map_t *m = &conf_config_map[i];
+			for (uint8_t j = 0; j < m->len; j++) { conf[m->offset+j] = EEPROM.read(config_addr(m->addr+j)); }
+		}
+	#endif
+	device_config_dirty = true;
+}
+
+bool device_config_valid() {
+	return device_config.magic == DEVICE_CONFIG_MAGIC &&
+	       device_config.version == DEVICE_CONFIG_VERSION &&
+	       device_config.length == sizeof(device_config_t) &&
+	       device_config.crc == device_config_crc();
+}
+
+void device_config_load() {
+	#if MCU_VARIANT == MCU_ESP32
+		EEPROM.get(config_addr(ADDR_CONF_BLOCK), device_config);
+	#elif !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
+		memset(&device_config, 0x00, sizeof(device_config_t));
+		if (file.open(CONFIG_FILE, FILE_O_READ)) {
+			file.read(&device_config, sizeof(device_config_t));
+			file.close();
+		}
+	#else
+		// Nowhere to keep the block on AVR, so it is
+		// rebuilt from the legacy layout at every boot
+		memset(&device_config, 0x00, sizeof(device_config_t));
+	#endif
+
+	if (!device_config_valid()) {
+		device_config_migrate();
+		#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+			eeprom_transaction_begin();
+			eeprom_transaction_commit();
+		#else
+			device_config_dirty = false;
+		#endif
+	}
+}
+
+bool csma_profile_valid(const csma_profile_t *p) {
+	return p->slot_min_ms > 0 && p->slot_max_ms >= p->slot_min_ms &&
+	       p->slot_symbols > 0 && p->difs_slots > 0 &&
+	       p->cw_bands > 0 && p->cw_per_band > 0 && (uint16_t)p->cw_bands*p->cw_per_band <= 256 &&
+	       p->band_1_max_airtime < p->band_n_min_airtime && p->band_n_min_airtime <= 100;
+}
+
+// Uses the CSMA profile saved in the config block,
+// or the compiled in defaults if none was saved
+void csma_profile_load() {
+	if (device_config.csma_set == CONF_OK_BYTE && csma_profile_valid(&device_config.csma)) {
+		csma_profile = device_config.csma;
+	} else {
+		csma_profile = csma_profile_default;
+	}
+}
+
+// The CSMA profile only exists in the config block,
+// since the legacy layout has no room left for it
+void csma_profile_save(bool persist) {
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+		eeprom_transaction_begin();
+		if (persist) { device_config.csma_set = CONF_OK_BYTE; device_config.csma = csma_profile; }
+		else         { device_config.csma_set = 0x00; }
+		device_config_dirty = true;
+		eeprom_transaction_commit();
+	#endif
+}
+
+void kiss_indicate_csma_profile() {
+	uint8_t *p = (uint8_t*)&csma_profile;
+	serial_write(FEND);
+	serial_write(CMD_CSMA_PROF);
+	for (uint8_t i = 0; i < sizeof(csma_profile_t); i++) { escaped_serial_write(p[i]); }
+	escaped_serial_write(device_config.csma_set == CONF_OK_BYTE ? 0x01 : 0x00);
+	serial_write(FEND);
+}
+
 void eeprom_write(uint8_t addr, uint8_t byte) {
 	if (!eeprom_info_locked() && addr >= 0 && addr < EEPROM_RESERVED) {
 		eeprom_update(eeprom_addr(addr), byte);
@@ -1587,10 +2170,14 @@ void eeprom_write(uint8_t addr, uint8_t byte) {
 void eeprom_erase() {
 	#if !HAS_EEPROM && MCU_VARIANT == MCU_NRF52
 		InternalFS.format();
+		eeprom_img_dirty = false;
+		device_config_file_dirty = false;
 	#else
+		eeprom_transaction_begin();
 		for (int addr = 0; addr < EEPROM_RESERVED; addr++) {
 			eeprom_update(eeprom_addr(addr), 0xFF);
 		}
+		eeprom_transaction_commit();
 	#endif
 	hard_reset();
 }
@@ -1767,8 +2354,10 @@ void db_conf_save(uint8_t val) {
 			display_blanking_enabled = true;
 			display_blanking_timeout = val*1000;
 		}
+		eeprom_transaction_begin();
 		eeprom_update(eeprom_addr(ADDR_CONF_BSET), CONF_OK_BYTE);
 		eeprom_update(eeprom_addr(ADDR_CONF_DBLK), val);
+		eeprom_transaction_commit();
 	#endif
 }
 
@@ -1788,17 +2377,15 @@ void dia_conf_save(uint8_t val) {
 }
 
 void np_int_conf_save(uint8_t p_int) {
+	eeprom_transaction_begin();
 	eeprom_update(eeprom_addr(ADDR_CONF_PSET), CONF_OK_BYTE);
 	eeprom_update(eeprom_addr(ADDR_CONF_PINT), p_int);
+	eeprom_transaction_commit();
 }
 
 
 bool eeprom_have_conf() {
-    #if HAS_EEPROM
-	    if (EEPROM.read(eeprom_addr(ADDR_CONF_OK)) == CONF_OK_BYTE) {
-    #elif MCU_VARIANT == MCU_NRF52
-        if (eeprom_read(eeprom_addr(ADDR_CONF_OK)) == CONF_OK_BYTE) {
-    #endif
+	if (device_config.conf_ok == CONF_OK_BYTE) {
 		return true;
 	} else {
 		return false;
@@ -1807,24 +2394,17 @@ bool eeprom_have_conf() {
 
 void eeprom_conf_load() {
 	if (eeprom_have_conf()) {
-        #if HAS_EEPROM
-            lora_sf = EEPROM.read(eeprom_addr(ADDR_CONF_SF));
-            lora_cr = EEPROM.read(eeprom_addr(ADDR_CONF_CR));
-            lora_txp = EEPROM.read(eeprom_addr(ADDR_CONF_TXP));
-            lora_freq = (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_FREQ)+0x00) << 24 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_FREQ)+0x01) << 16 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_FREQ)+0x02) << 8 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_FREQ)+0x03);
-            lora_bw = (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_BW)+0x00) << 24 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_BW)+0x01) << 16 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_BW)+0x02) << 8 | (uint32_t)EEPROM.read(eeprom_addr(ADDR_CONF_BW)+0x03);
-        #elif MCU_VARIANT == MCU_NRF52
-            lora_sf = eeprom_read(eeprom_addr(ADDR_CONF_SF));
-            lora_cr = eeprom_read(eeprom_addr(ADDR_CONF_CR));
-            lora_txp = eeprom_read(eeprom_addr(ADDR_CONF_TXP));
-            lora_freq = (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_FREQ)+0x00) << 24 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_FREQ)+0x01) << 16 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_FREQ)+0x02) << 8 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_FREQ)+0x03);
-            lora_bw = (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_BW)+0x00) << 24 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_BW)+0x01) << 16 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_BW)+0x02) << 8 | (uint32_t)eeprom_read(eeprom_addr(ADDR_CONF_BW)+0x03);
-        #endif
+		lora_sf = device_config.conf_sf;
+		lora_cr = device_config.conf_cr;
+		lora_txp = device_config.conf_txp;
+		lora_freq = (uint32_t)device_config.conf_freq[0] << 24 | (uint32_t)device_config.conf_freq[1] << 16 | (uint32_t)device_config.conf_freq[2] << 8 | (uint32_t)device_config.conf_freq[3];
+		lora_bw = (uint32_t)device_config.conf_bw[0] << 24 | (uint32_t)device_config.conf_bw[1] << 16 | (uint32_t)device_config.conf_bw[2] << 8 | (uint32_t)device_config.conf_bw[3];
 	}
 }
 
 void eeprom_conf_save() {
 	if (hw_ready && radio_online) {
+		eeprom_transaction_begin();
 		eeprom_update(eeprom_addr(ADDR_CONF_SF), lora_sf);
 		eeprom_update(eeprom_addr(ADDR_CONF_CR), lora_cr);
 		eeprom_update(eeprom_addr(ADDR_CONF_TXP), lora_txp);
@@ -1840,6 +2420,7 @@ void eeprom_conf_save() {
 		eeprom_update(eeprom_addr(ADDR_CONF_FREQ)+0x03, lora_freq);
 
 		eeprom_update(eeprom_addr(ADDR_CONF_OK), CONF_OK_BYTE);
+		eeprom_transaction_commit();
 		led_indicate_info(10);
 	} else {
 		led_indicate_warning(10);
@@ -1984,6 +2565,10 @@ inline uint16_t fifo16_pop(FIFOBuffer16 *f) {
   }
 }
 
+inline uint16_t fifo16_peek(const FIFOBuffer16 *f) {
+  return *(f->head);
+}
+
 inline void fifo16_flush(FIFOBuffer16 *f) {
   f->head = f->tail;
 }
@@ -2041,4 +2626,17 @@ void host_disconnected() {
 	last_rssi     = -292;
 	last_rssi_raw = 0x00;
 	last_snr_raw  = 0x80;
+	rx_ext        = false;
+	credits_enabled = false;
+	#if MCU_VARIANT == MCU_ESP32 || MCU_VARIANT == MCU_NRF52
+		aggr_window_ms = AGGR_WINDOW_MS;
+		arq_enabled   = false;
+		arq_state.waiting = false;
+	#endif
+	#if HAS_CAD
+		cad_enabled   = CSMA_CAD;
+	#endif
+	#if HAS_FRAG
+		frag_mode     = false;
+	#endif
 }
\ No newline at end of file
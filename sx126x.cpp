@@ -41,6 +41,7 @@
 #define OP_DIO3_TCXO_CTRL_6X        0x97
 #define OP_DIO2_RF_CTRL_6X          0x9D
 #define OP_CAD_PARAMS               0x88
+#define OP_SET_CAD_6X               0xC5
 #define OP_CALIBRATE_6X             0x89
 #define OP_RX_TX_FALLBACK_MODE_6X   0x93
 #define OP_REGULATOR_MODE_6X        0x96
@@ -53,6 +54,8 @@
 #define IRQ_HEADER_DET_MASK_6X      0x10
 #define IRQ_PREAMBLE_DET_MASK_6X    0x04
 #define IRQ_PAYLOAD_CRC_ERROR_MASK_6X 0x40
+#define IRQ_CAD_DONE_MASK_6X        0x80
+#define IRQ_CAD_DETECTED_MASK_6X    0x01 // In the high byte
 #define IRQ_ALL_MASK_6X             0b0100001111111111
 
 #define MODE_LONG_RANGE_MODE_6X     0x01
@@ -126,7 +129,9 @@ sx126x::sx126x() :
   _fifo_rx_addr_ptr(0),
   _packet({0}),
   _preinit_done(false),
-  _onReceive(NULL)
+  _onReceive(NULL),
+  _cad_active(false),
+  _cad_detected(false)
 { setTimeout(0); }
 
 bool sx126x::preInit() {
@@ -447,6 +452,7 @@ int sx126x::beginPacket(int implicitHeader) {
   #endif
 
   standby();
+  _cad_active = false;
   if (implicitHeader) { implicitHeaderMode(); }
   else { explicitHeaderMode(); }
 
@@ -520,6 +526,37 @@ bool sx126x::dcd() {
   return carrier_detected;
 }
 
+// Starts a channel activity detection scan. The
+// result is picked up from the CAD done interrupt,
+// after which the modem goes back to receive mode.
+bool sx126x::startCad() {
+  if (_cad_active) { return false; }
+  standby();
+
+  // Detection thresholds as recommended in Semtech
+  // AN1200.48 for a two symbol scan
+  uint8_t params[7] = {0};
+  params[0] = 0x01;     // Two symbols
+  params[1] = _sf+13;   // Detection peak
+  params[2] = 10;       // Detection minimum
+  params[3] = 0x00;     // Return to standby when done
+  executeOpcode(OP_CAD_PARAMS, params, 7);
+
+  _cad_active = true;
+  executeOpcode(OP_SET_CAD_6X, NULL, 0);
+  return true;
+}
+
+bool sx126x::cadActive() { return _cad_active; }
+bool sx126x::cadDetected() { return _cad_detected; }
+
+void sx126x::cadAbort() {
+  if (_cad_active) {
+    _cad_active = false;
+    receive(_implicitHeaderMode ? _payloadLength : 0);
+  }
+}
+
 uint8_t sx126x::currentRssiRaw() {
   uint8_t byte = 0;
   executeOpcodeRead(OP_CURRENT_RSSI_6X, &byte, 1);
@@ -574,8 +611,7 @@ float ISR_VECT sx126x::packetSnr() {
 
 long sx126x::packetFrequencyError() {
   // TODO: Implement this, no idea how to check it on the sx1262
-  const float fError = 0.0;
-  return static_cast<long>(fError);
+  return FREQ_ERROR_UNAVAILABLE;
 }
 
 size_t sx126x::write(uint8_t byte) { return write(&byte, sizeof(byte)); }
@@ -632,7 +668,7 @@ void sx126x::onReceive(void(*callback)(int)){
     buf[0] = 0xFF;  // Set irq masks, enable all
     buf[1] = 0xFF;
     buf[2] = 0x00;  // Set dio0 masks
-    buf[3] = IRQ_RX_DONE_MASK_6X; 
+    buf[3] = IRQ_RX_DONE_MASK_6X | IRQ_CAD_DONE_MASK_6X; 
     buf[4] = 0x00;  // Set dio1 masks
     buf[5] = 0x00;
     buf[6] = 0x00;  // Set dio2 masks 
@@ -864,6 +900,17 @@ void ISR_VECT sx126x::handleDio0Rise() {
   executeOpcodeRead(OP_GET_IRQ_STATUS_6X, buf, 2);
   executeOpcode(OP_CLEAR_IRQ_STATUS_6X, buf, 2);
 
+  if (_cad_active && (buf[1] & IRQ_CAD_DONE_MASK_6X) != 0) {
+    _cad_detected = (buf[0] & IRQ_CAD_DETECTED_MASK_6X) != 0;
+    _cad_active = false;
+    receive(_implicitHeaderMode ? _payloadLength : 0);
+    return;
+  }
+
+  // A CAD done interrupt that arrives after the scan
+  // was aborted carries no packet, and is dropped here
+  if ((buf[1] & IRQ_RX_DONE_MASK_6X) == 0) { return; }
+
   if ((buf[1] & IRQ_PAYLOAD_CRC_ERROR_MASK_6X) == 0) {
     _packetIndex = 0;
     uint8_t rxbuf[2] = {0}; // Read packet length
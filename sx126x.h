@@ -21,6 +21,10 @@
 
 #define RSSI_OFFSET 157
 
+// Reported instead of a frequency error, which the
+// SX126x has no documented way of measuring
+#define FREQ_ERROR_UNAVAILABLE (-2147483647L-1)
+
 class sx126x : public Stream {
 public:
   sx126x();
@@ -70,6 +74,10 @@ public:
   void setPreambleLength(long preamble_symbols);
   void setSyncWord(uint16_t sw);
   bool dcd();
+  bool startCad();
+  bool cadActive();
+  bool cadDetected();
+  void cadAbort();
   void enableCrc();
   void disableCrc();
   void enableTCXO();
@@ -138,6 +146,8 @@ private:
   uint8_t _packet[255];
   bool _preinit_done;
   void (*_onReceive)(int);
+  volatile bool _cad_active;
+  volatile bool _cad_detected;
 };
 
 extern sx126x sx126x_modem;
@@ -57,6 +57,8 @@
 #define OP_BUFFER_BASE_ADDR_8X      0x8F
 #define OP_READ_REGISTER_8X         0x19
 #define OP_WRITE_REGISTER_8X        0x18
+#define OP_CAD_PARAMS_8X            0x88
+#define OP_SET_CAD_8X               0xC5
 #define IRQ_TX_DONE_MASK_8X         0x01
 #define IRQ_RX_DONE_MASK_8X         0x02
 #define IRQ_HEADER_DET_MASK_8X      0x10
@@ -68,6 +70,8 @@
 #define OP_FIFO_WRITE_8X            0x1A
 #define OP_FIFO_READ_8X             0x1B
 #define IRQ_PREAMBLE_DET_MASK_8X    0x80
+#define IRQ_CAD_DONE_MASK_8X        0x10 // In the high byte
+#define IRQ_CAD_DETECTED_MASK_8X    0x20 // In the high byte
 
 #define REG_PACKET_SIZE             0x901
 #define REG_FIRM_VER_MSB            0x154
@@ -90,7 +94,7 @@ sx128x::sx128x() :
   _spiSettings(8E6, MSBFIRST, SPI_MODE0),
   _ss(LORA_DEFAULT_SS_PIN), _reset(LORA_DEFAULT_RESET_PIN), _dio0(LORA_DEFAULT_DIO0_PIN), _rxen(pin_rxen), _busy(LORA_DEFAULT_BUSY_PIN), _txen(pin_txen),
   _frequency(0), _txp(0), _sf(0x05), _bw(0x34), _cr(0x01), _packetIndex(0), _implicitHeaderMode(0), _payloadLength(255), _crcMode(0), _fifo_tx_addr_ptr(0),
-  _fifo_rx_addr_ptr(0), _rxPacketLength(0), _preinit_done(false), _tcxo(false) { setTimeout(0); }
+  _fifo_rx_addr_ptr(0), _rxPacketLength(0), _preinit_done(false), _tcxo(false), _cad_active(false), _cad_detected(false) { setTimeout(0); }
 
 bool ISR_VECT sx128x::getPacketValidity() {
     uint8_t buf[2];
@@ -98,6 +102,9 @@ bool ISR_VECT sx128x::getPacketValidity() {
     buf[1] = 0x00;
     executeOpcodeRead(OP_GET_IRQ_STATUS_8X, buf, 2);
     executeOpcode(OP_CLEAR_IRQ_STATUS_8X, buf, 2);
+    // Interrupts without RX done, such as a CAD done
+    // arriving after the scan was aborted, carry no packet
+    if ((buf[1] & IRQ_RX_DONE_MASK_8X) == 0) { return false; }
     if ((buf[1] & IRQ_PAYLOAD_CRC_ERROR_MASK_8X) == 0) { return true; }
     else { return false; }
 }
@@ -109,8 +116,9 @@ void ISR_VECT sx128x::onDio0Rise() {
     // in continuous RX mode. This is documented as Errata 16.1 in
     // the SX1280 datasheet v3.2 (page 149)
     // Therefore, the modem is set into receive mode each time a packet is received.
-    if (sx128x_modem.getPacketValidity()) { sx128x_modem.receive(); sx128x_modem.handleDio0Rise(); }
-    else                                  { sx128x_modem.receive(); }
+    if (sx128x_modem._cad_active)              { sx128x_modem.handleCadDone(); }
+    else if (sx128x_modem.getPacketValidity()) { sx128x_modem.receive(); sx128x_modem.handleDio0Rise(); }
+    else                                       { sx128x_modem.receive(); }
 
     taskEXIT_CRITICAL_FROM_ISR(int_status);
 }
@@ -128,6 +136,15 @@ void sx128x::handleDio0Rise() {
     if (_receive_callback) { _receive_callback(_rxPacketLength); }
 }
 
+void sx128x::handleCadDone() {
+    uint8_t buf[2] = {0};
+    executeOpcodeRead(OP_GET_IRQ_STATUS_8X, buf, 2);
+    executeOpcode(OP_CLEAR_IRQ_STATUS_8X, buf, 2);
+    _cad_detected = (buf[0] & IRQ_CAD_DETECTED_MASK_8X) != 0;
+    _cad_active = false;
+    receive(_implicitHeaderMode ? _payloadLength : 0);
+}
+
 bool sx128x::preInit() {
   pinMode(_ss, OUTPUT);
   digitalWrite(_ss, HIGH);
@@ -355,6 +372,7 @@ void sx128x::end() {
 
 int sx128x::beginPacket(int implicitHeader) {
   standby();
+  _cad_active = false;
 
   if (implicitHeader) { implicitHeaderMode(); }
   else { explicitHeaderMode(); }
@@ -433,6 +451,31 @@ bool sx128x::dcd() {
 }
 
 
+// Starts a channel activity detection scan. The
+// result is picked up from the CAD done interrupt,
+// after which the modem goes back to receive mode.
+bool sx128x::startCad() {
+  if (_cad_active) { return false; }
+  standby();
+
+  uint8_t symbols = 0x40; // Four symbols
+  executeOpcode(OP_CAD_PARAMS_8X, &symbols, 1);
+
+  _cad_active = true;
+  executeOpcode(OP_SET_CAD_8X, NULL, 0);
+  return true;
+}
+
+bool sx128x::cadActive() { return _cad_active; }
+bool sx128x::cadDetected() { return _cad_detected; }
+
+void sx128x::cadAbort() {
+  if (_cad_active) {
+    _cad_active = false;
+    receive(_implicitHeaderMode ? _payloadLength : 0);
+  }
+}
+
 uint8_t sx128x::currentRssiRaw() {
     uint8_t byte = 0;
     executeOpcodeRead(OP_CURRENT_RSSI_8X, &byte, 1);
@@ -474,9 +517,7 @@ float ISR_VECT sx128x::packetSnr() {
 
 long sx128x::packetFrequencyError() {
   // TODO: Implement this, page 120 of sx1280 datasheet
-  int32_t freqError = 0;
-  const float fError = 0.0;
-  return static_cast<long>(fError);
+  return FREQ_ERROR_UNAVAILABLE;
 }
 
 void sx128x::flush() { }
@@ -545,7 +586,7 @@ void sx128x::onReceive(void(*callback)(int)) {
     // modem can be set into RX mode again on reception of a corrupted
     // header.
     // set dio0 masks
-    buf[2] = 0x00;
+    buf[2] = IRQ_CAD_DONE_MASK_8X;
     buf[3] = IRQ_RX_DONE_MASK_8X | IRQ_HEADER_ERROR_MASK_8X; 
 
     // Set dio1 masks
@@ -19,6 +19,10 @@
 #define PA_OUTPUT_PA_BOOST_PIN  1
 #define RSSI_OFFSET             157
 
+// Reported instead of a frequency error, which is
+// not yet read from the SX128x
+#define FREQ_ERROR_UNAVAILABLE  (-2147483647L-1)
+
 class sx128x : public Stream {
 public:
   sx128x();
@@ -70,6 +74,10 @@ public:
   void setPreambleLength(long preamble_symbols);
   void setSyncWord(int sw);
   bool dcd();
+  bool startCad();
+  bool cadActive();
+  bool cadDetected();
+  void cadAbort();
   void clearIRQStatus();
   void enableCrc();
   void disableCrc();
@@ -101,6 +109,7 @@ private:
 
   bool getPacketValidity();
   void handleDio0Rise();
+  void handleCadDone();
 
   uint8_t readRegister(uint16_t address);
   void writeRegister(uint16_t address, uint8_t value);
@@ -139,6 +148,8 @@ private:
   int _rxPacketLength;
   uint32_t _bitrate;
   void (*_receive_callback)(int);
+  volatile bool _cad_active;
+  volatile bool _cad_detected;
 };
 
 extern sx128x sx128x_modem;